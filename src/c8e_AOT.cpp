@@ -0,0 +1,28 @@
+#include <string.h>
+
+#include "c8e_AOT.h"
+
+// function local so registrations from other translation units can run in any order
+static c8e_AOTProgram*& Programs()
+{
+	static c8e_AOTProgram* s_programs = NULL;
+	return s_programs;
+}
+
+void c8e_AOT::Register(c8e_AOTProgram* program)
+{
+	program->next = Programs();
+	Programs() = program;
+}
+
+const c8e_AOTProgram* c8e_AOT::Find(const u8* rom, int romSize)
+{
+	for (const c8e_AOTProgram* program = Programs(); program; program = program->next)
+	{
+		if (program->romSize == romSize && memcmp(program->rom, rom, romSize) == 0)
+		{
+			return program;
+		}
+	}
+	return NULL;
+}
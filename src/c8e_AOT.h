@@ -0,0 +1,61 @@
+#pragma once
+
+#include "c8e_CPU.h"
+
+typedef int (*c8e_AOTRun)(c8e_CPU* cpu, int budget);
+
+// A rom translated to C++ by c8e_Recompiler and linked into the executable
+struct c8e_AOTProgram
+{
+	const char* name;
+	const u8* rom; // image the translation was made from, matched against the loaded rom
+	int romSize;
+	const u16* code; // start and end address pairs covering every translated instruction
+	int codeRanges;
+	c8e_AOTRun run; // runs up to budget instructions from the program counter, returns the budget left
+	c8e_AOTProgram* next;
+};
+
+// Registry of linked programs, and the view of c8e_CPU that generated code works on
+struct c8e_AOT
+{
+public:
+	static void Register(c8e_AOTProgram* program);
+	static const c8e_AOTProgram* Find(const u8* rom, int romSize);
+
+	static u8* V(c8e_CPU* cpu) { return cpu->m_state.V; }
+	static u8* Ram(c8e_CPU* cpu) { return cpu->m_state.ram; }
+	static u16& I(c8e_CPU* cpu) { return cpu->m_state.I; }
+	static u8& Delay(c8e_CPU* cpu) { return cpu->m_state.delay; }
+	static const u64& CodeWrites(c8e_CPU* cpu) { return cpu->m_codeWrites; }
+
+	static int GetPC(c8e_CPU* cpu) { return cpu->m_state.pc; }
+	static void SetPC(c8e_CPU* cpu, int address) { cpu->m_state.pc = address & RAM_MASK; }
+
+	// run one instruction through the interpreter's handler, with the program counter already past it
+	static void Call(c8e_CPU* cpu, u16 opcode, int next)
+	{
+		SetPC(cpu, next);
+		const c8e_Op& op = c8e_CPU::LookupOp(opcode);
+		op.handler(cpu, op);
+	}
+
+	// true if any byte in [start, end) was overwritten since the rom was loaded
+	static bool IsStale(c8e_CPU* cpu, int start, int end)
+	{
+		for (int i = start; i < end; i++)
+		{
+			if (!cpu->m_codeMap[i])
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+// Generated sources declare one of these at file scope to add their program to the registry
+struct c8e_AOTRegistration
+{
+	c8e_AOTRegistration(c8e_AOTProgram* program) { c8e_AOT::Register(program); }
+};
@@ -0,0 +1,281 @@
+#define _USE_MATH_DEFINES // M_PI on MSVC
+#include <math.h>
+#include <string.h>
+
+#include "c8e_Audio.h"
+
+c8e_Audio::c8e_Audio(int sampleRate)
+{
+	m_sampleRate = sampleRate;
+	BuildTable(&m_tables[m_playing], WAVE_SINE, AUDIO_TONE_HZ);
+}
+
+void c8e_Audio::SetTone(int waveform, int pitch)
+{
+	if (pitch < AUDIO_MIN_PITCH)
+	{
+		pitch = AUDIO_MIN_PITCH;
+	}
+	if (pitch > m_sampleRate / 4)
+	{
+		pitch = m_sampleRate / 4;
+	}
+
+	// summing a few hundred harmonics per entry is far too slow for the audio callback
+	BuildTable(&m_tables[m_building], waveform, pitch);
+	m_building = m_ready.exchange(m_building | AUDIO_TABLE_FRESH, std::memory_order_acq_rel) & ~AUDIO_TABLE_FRESH;
+}
+
+void c8e_Audio::PushEdge(u64 cycle, bool on)
+{
+	u32 head = m_head.load(std::memory_order_relaxed);
+	if (head - m_tail.load(std::memory_order_acquire) == AUDIO_EDGE_RING)
+	{
+		m_droppedEdges++; // the callback isn't running
+		return;
+	}
+	m_edges[head & (AUDIO_EDGE_RING - 1)].cycle = cycle;
+	m_edges[head & (AUDIO_EDGE_RING - 1)].on = on;
+	m_edges[head & (AUDIO_EDGE_RING - 1)].restart = false;
+	m_head.store(head + 1, std::memory_order_release);
+}
+
+void c8e_Audio::Restart(u64 cycle, bool on)
+{
+	// the clock moves first, so the callback never pairs the restart with the old clock
+	m_clock.store(cycle, std::memory_order_release);
+
+	u32 head = m_head.load(std::memory_order_relaxed);
+	if (head - m_tail.load(std::memory_order_acquire) == AUDIO_EDGE_RING)
+	{
+		m_droppedEdges++; // the callback isn't running, it snaps to the new clock anyway
+		return;
+	}
+	m_edges[head & (AUDIO_EDGE_RING - 1)].cycle = cycle;
+	m_edges[head & (AUDIO_EDGE_RING - 1)].on = on;
+	m_edges[head & (AUDIO_EDGE_RING - 1)].restart = true;
+	m_head.store(head + 1, std::memory_order_release);
+}
+
+void c8e_Audio::Sync(u64 cycle, int clockspeed)
+{
+	m_clockspeed.store(clockspeed, std::memory_order_relaxed);
+	m_clock.store(cycle, std::memory_order_release);
+}
+
+void c8e_Audio::Render(short* samples, int count)
+{
+	int clockspeed = m_clockspeed.load(std::memory_order_relaxed);
+	if (clockspeed == 0)
+	{
+		memset(samples, 0, count * sizeof(short));
+		return;
+	}
+
+	DropStaleEdges();
+
+	if (m_ready.load(std::memory_order_relaxed) & AUDIO_TABLE_FRESH)
+	{
+		m_playing = m_ready.exchange(m_playing, std::memory_order_acq_rel) & ~AUDIO_TABLE_FRESH;
+	}
+
+	// keep the cursor a fixed distance behind the emulated clock, so edges arrive before they are played
+	u64 latest = m_clock.load(std::memory_order_acquire) * m_sampleRate;
+	u64 targetLag = (u64)clockspeed * m_sampleRate * AUDIO_LAG_MS / 1000;
+	u64 maxLag = (u64)clockspeed * m_sampleRate * AUDIO_MAX_LAG_MS / 1000;
+	if (!m_started || m_cursor + maxLag < latest || m_cursor > latest)
+	{
+		m_cursor = (latest > targetLag) ? latest - targetLag : 0;
+		m_started = true;
+	}
+	m_lagTotal.fetch_add(latest - m_cursor, std::memory_order_relaxed);
+	m_lagCount.fetch_add(1, std::memory_order_relaxed);
+	UpdateRate(latest - m_cursor, clockspeed);
+
+	u32 tail = m_tail.load(std::memory_order_relaxed);
+	u32 head = m_head.load(std::memory_order_acquire);
+	u64 time = m_cursor;
+	int done = 0;
+	while (done < count)
+	{
+		// an edge takes effect on the first sample at or after its cycle, everything before it is one steady state
+		int end = count;
+		if (tail != head)
+		{
+			const c8e_SoundEdge& edge = m_edges[tail & (AUDIO_EDGE_RING - 1)];
+			u64 edgeTime = edge.cycle * m_sampleRate;
+			if (edgeTime <= time)
+			{
+				m_on = edge.on;
+				tail++;
+				continue;
+			}
+			u64 before = (edgeTime - time + clockspeed - 1) / clockspeed;
+			if (before < (u64)(count - done))
+			{
+				end = done + (int)before;
+			}
+		}
+		Synthesize(samples + done, end - done);
+		time += (u64)(end - done) * clockspeed;
+		done = end;
+	}
+	m_tail.store(tail, std::memory_order_release);
+
+	// ran past what has been emulated, the end of this buffer held the last state and is played again
+	if (time > latest)
+	{
+		m_underruns.fetch_add(1, std::memory_order_relaxed);
+		time = latest;
+	}
+	m_cursor = time;
+}
+
+void c8e_Audio::DropStaleEdges()
+{
+	// edges before the newest restart belong to a timeline that no longer exists
+	u32 tail = m_tail.load(std::memory_order_relaxed);
+	u32 head = m_head.load(std::memory_order_acquire);
+	u32 restart = head;
+	for (u32 i = tail; i != head; i++)
+	{
+		if (m_edges[i & (AUDIO_EDGE_RING - 1)].restart)
+		{
+			restart = i;
+		}
+	}
+	if (restart == head)
+	{
+		return;
+	}
+
+	m_on = m_edges[restart & (AUDIO_EDGE_RING - 1)].on;
+	m_started = false;
+	m_tail.store(restart + 1, std::memory_order_release);
+}
+
+void c8e_Audio::Mix(short* samples, int count)
+{
+	short chunk[AUDIO_MIX_CHUNK];
+	while (count > 0)
+	{
+		int n = (count < AUDIO_MIX_CHUNK) ? count : AUDIO_MIX_CHUNK;
+		Render(chunk, n);
+		for (int i = 0; i < n; i++)
+		{
+			int mixed = samples[i] + chunk[i];
+			samples[i] = (short)((mixed > 32767) ? 32767 : (mixed < -32768) ? -32768 : mixed);
+		}
+		samples += n;
+		count -= n;
+	}
+}
+
+void c8e_Audio::Synthesize(short* samples, int count)
+{
+	int ramped = Ramp(samples, count);
+	samples += ramped;
+	count -= ramped;
+
+	// steady state, a straight table lookup per sample
+	if (m_gain == 0)
+	{
+		memset(samples, 0, count * sizeof(short));
+		m_phase += m_tables[m_playing].phaseStep * (u32)count;
+		return;
+	}
+
+	u32 phase = m_phase;
+	u32 step = m_tables[m_playing].phaseStep;
+	const short* table = m_tables[m_playing].samples;
+	for (int i = 0; i < count; i++)
+	{
+		samples[i] = table[(phase + step * (u32)i) >> (32 - AUDIO_TABLE_BITS)];
+	}
+	m_phase = phase + step * (u32)count;
+}
+
+int c8e_Audio::Ramp(short* samples, int count)
+{
+	// linear attack and release instead of a hard step
+	int direction = m_on ? 1 : -1;
+	int target = m_on ? AUDIO_RAMP_SAMPLES : 0;
+	const c8e_WaveTable& table = m_tables[m_playing];
+	int n = 0;
+	while (n < count && m_gain != target)
+	{
+		m_gain += direction;
+		samples[n] = (short)(table.samples[m_phase >> (32 - AUDIO_TABLE_BITS)] * m_gain / AUDIO_RAMP_SAMPLES);
+		m_phase += table.phaseStep;
+		n++;
+	}
+	return n;
+}
+
+void c8e_Audio::BuildTable(c8e_WaveTable* table, int waveform, int pitch)
+{
+	// sum harmonics up to the Nyquist frequency of the output, then normalise the overshoot away
+	int harmonics = m_sampleRate / 2 / pitch;
+	double values[AUDIO_TABLE_SIZE];
+	double peak = 0.0;
+	for (int i = 0; i < AUDIO_TABLE_SIZE; i++)
+	{
+		double x = 2.0 * M_PI * i / AUDIO_TABLE_SIZE;
+		double value = 0.0;
+		if (waveform == WAVE_SQUARE)
+		{
+			for (int k = 1; k <= harmonics; k += 2)
+			{
+				value += sin(k * x) / k;
+			}
+		}
+		else if (waveform == WAVE_TRIANGLE)
+		{
+			for (int k = 1; k <= harmonics; k += 2)
+			{
+				value += ((k & 2) ? -1.0 : 1.0) * sin(k * x) / ((double)k * k);
+			}
+		}
+		else
+		{
+			value = sin(x);
+		}
+		values[i] = value;
+		peak = (fabs(value) > peak) ? fabs(value) : peak;
+	}
+	for (int i = 0; i < AUDIO_TABLE_SIZE; i++)
+	{
+		table->samples[i] = (short)(values[i] * AUDIO_AMPLITUDE / peak);
+	}
+	table->phaseStep = (u32)(((u64)pitch << 32) / m_sampleRate);
+}
+
+void c8e_Audio::UpdateRate(u64 lag, int clockspeed)
+{
+	// more emulated audio queued than the target means the emulation runs fast against the device clock
+	double lagMs = lag * 1000.0 / clockspeed / m_sampleRate;
+	m_fill += (lagMs - m_fill) / AUDIO_FILL_SMOOTHING;
+
+	int adjust = (int)((AUDIO_LAG_MS - m_fill) * AUDIO_RATE_PPM_PER_MS);
+	if (adjust > AUDIO_RATE_LIMIT_PPM)
+	{
+		adjust = AUDIO_RATE_LIMIT_PPM;
+	}
+	if (adjust < -AUDIO_RATE_LIMIT_PPM)
+	{
+		adjust = -AUDIO_RATE_LIMIT_PPM;
+	}
+	m_fillUs.store((int)(m_fill * 1000.0), std::memory_order_relaxed);
+	m_rateAdjust.store(adjust, std::memory_order_relaxed);
+}
+
+double c8e_Audio::GetLag()
+{
+	u64 count = m_lagCount.load(std::memory_order_relaxed);
+	int clockspeed = m_clockspeed.load(std::memory_order_relaxed);
+	if (count == 0 || clockspeed == 0)
+	{
+		return 0.0;
+	}
+	return m_lagTotal.load(std::memory_order_relaxed) * 1000.0 / count / clockspeed / m_sampleRate;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+
+#include "c8e_constants.h"
+
+#define AUDIO_EDGE_RING (256) // sound edges in flight between the emulation and the callback, must be a power of two
+#define AUDIO_LAG_MS (25) // how far the callback trails the emulated clock, one frame plus one buffer
+#define AUDIO_MAX_LAG_MS (100) // trailing further than this snaps back to AUDIO_LAG_MS
+#define AUDIO_RAMP_SAMPLES (64) // attack and release length, long enough not to click
+#define AUDIO_AMPLITUDE (28000)
+#define AUDIO_TONE_HZ (441) // default pitch
+#define AUDIO_MIN_PITCH (55) // lowest pitch, bounds the harmonics summed when a table is built
+#define AUDIO_TABLE_BITS (11) // one period of the waveform in 2048 entries
+#define AUDIO_TABLE_SIZE (1 << AUDIO_TABLE_BITS)
+#define AUDIO_TABLE_FRESH (1 << 2) // flags a table index handed over by SetTone that the callback hasn't taken yet
+#define AUDIO_MIX_CHUNK (256) // samples synthesized per pass before mixing
+#define AUDIO_FILL_SMOOTHING (64) // callbacks averaged into the fill level, irons out the per-frame sawtooth
+#define AUDIO_RATE_PPM_PER_MS (500) // emulation speed correction per millisecond of fill error
+#define AUDIO_RATE_LIMIT_PPM (5000) // corrections never exceed 0.5%
+
+// Beeper waveforms, square and triangle are built from harmonics below the Nyquist frequency so they don't alias
+#define WAVE_SINE (0)
+#define WAVE_SQUARE (1)
+#define WAVE_TRIANGLE (2)
+
+// The sound timer switching on or off at an emulated cycle
+struct c8e_SoundEdge
+{
+	u64 cycle;
+	bool on;
+	bool restart; // the emulated clock jumped to cycle, everything queued before it is stale
+};
+
+// One period of the beeper at one pitch
+struct c8e_WaveTable
+{
+	short samples[AUDIO_TABLE_SIZE];
+	u32 phaseStep; // advance per output sample
+};
+
+// Renders the beeper from timestamped edges, fed by the emulation thread and read by the audio callback
+struct c8e_Audio
+{
+public:
+	c8e_Audio(int sampleRate);
+
+	// emulation side
+	void PushEdge(u64 cycle, bool on);
+	void Sync(u64 cycle, int clockspeed); // every cycle before this has been emulated
+	void Restart(u64 cycle, bool on); // a state was loaded, the clock continues from cycle
+
+	// one thread at a time, builds the table there and hands it to the next callback
+	void SetTone(int waveform, int pitch);
+
+	// audio callback side
+	void Render(short* samples, int count);
+	void Mix(short* samples, int count); // adds to what is already there, for several instances sharing a device
+
+	u64 GetUnderruns() { return m_underruns.load(std::memory_order_relaxed); }
+	u64 GetDroppedEdges() { return m_droppedEdges; }
+	double GetLag(); // average milliseconds the callback trailed the emulated clock
+
+	// rate control, for running the emulation from the audio clock
+	double GetFill() { return m_fillUs.load(std::memory_order_relaxed) / 1000.0; } // smoothed milliseconds of emulated audio waiting to play
+	int GetRateAdjust() { return m_rateAdjust.load(std::memory_order_relaxed); } // parts per million to add to the emulation speed
+
+private:
+	void DropStaleEdges();
+	void Synthesize(short* samples, int count);
+	int Ramp(short* samples, int count);
+	void BuildTable(c8e_WaveTable* table, int waveform, int pitch);
+	void UpdateRate(u64 lag, int clockspeed);
+
+	int m_sampleRate;
+
+	// single producer, single consumer ring
+	c8e_SoundEdge m_edges[AUDIO_EDGE_RING];
+	std::atomic<u32> m_head{ 0 }; // written by the emulation
+	std::atomic<u32> m_tail{ 0 }; // written by the callback
+	u64 m_droppedEdges = 0;
+
+	std::atomic<u64> m_clock{ 0 }; // emulated cycle reached
+	std::atomic<int> m_clockspeed{ 0 }; // 0 until the first Sync
+
+	// callback state, the timeline counts m_sampleRate units per cycle and clockspeed units per sample
+	u64 m_cursor = 0; // timeline position of the next sample
+	bool m_started = false;
+	bool m_on = false;
+	int m_gain = 0; // 0 to AUDIO_RAMP_SAMPLES
+
+	// wavetable oscillator, the top AUDIO_TABLE_BITS of the phase index the table. Tables are triple buffered
+	// so building one never touches what the callback plays: SetTone owns one, the callback another, and
+	// the third waits in m_ready to be swapped by whichever side comes next
+	c8e_WaveTable m_tables[3];
+	int m_building = 2; // SetTone side
+	int m_playing = 0; // callback side
+	std::atomic<int> m_ready{ 1 };
+	u32 m_phase = 0;
+
+	std::atomic<u64> m_underruns{ 0 };
+	std::atomic<u64> m_lagTotal{ 0 }; // in timeline units
+	std::atomic<u64> m_lagCount{ 0 };
+
+	double m_fill = AUDIO_LAG_MS; // callback only
+	std::atomic<int> m_fillUs{ AUDIO_LAG_MS * 1000 };
+	std::atomic<int> m_rateAdjust{ 0 };
+};
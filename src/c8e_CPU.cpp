@@ -7,29 +7,168 @@
 
 #include "c8e_constants.h"
 #include "c8e_CPU.h"
+#include "c8e_AOT.h"
+#include "c8e_Audio.h"
+#include "c8e_JIT.h"
+#include "c8e_Movie.h"
 
-#define RAM_SIZE (4096)
-#define PROGRAM_OFFSET (512)
-#define STACK_SIZE (16)
-#define NUM_REGISTERS (16)
-#define FONT_OFFSET (80)
-#define FONT_HEIGHT (5)
+#define _INSTRUCTION(val) ((val >> 4) & 0x0f)
+#define _X(val) ((val >> 0) & 0x0f)
+#define _Y(val) ((val >> 12)  & 0x0f)
+#define _N(val) ((val >> 8) & 0x0f)
+#define _NN(val) ((_Y(val) << 4) | _N(val))
+#define _NNN(val) ((_X(val) << 8) | (_Y(val) << 4) | _N(val))
+#define _VF (m_state.V[0x0f])
 
-c8e_CPU::c8e_CPU()
+// Every possible opcode decoded ahead of time, a single load replaces the cascaded switch
+struct c8e_OpTable
 {
-	m_ram = (u8*)calloc(RAM_SIZE, sizeof(u8));
-	m_pc = (u16*)(m_ram + PROGRAM_OFFSET);
+	c8e_Op ops[0x10000];
+
+	constexpr c8e_OpTable() : ops()
+	{
+		for (int i = 0; i < 0x10000; i++)
+		{
+			ops[i] = Make((u16)i);
+		}
+	}
+
+	static constexpr c8e_Op Make(u16 opcode)
+	{
+		c8e_Op op = {};
+		op.handler = c8e_CPU::Op_Trap;
+		op.nnn = _NNN(opcode);
+		op.x = _X(opcode);
+		op.y = _Y(opcode);
+		op.n = _N(opcode);
+		op.nn = _NN(opcode);
+		op.length = 1;
+
+		switch (_INSTRUCTION(opcode))
+		{
+			case 0x00:
+			{
+				op.handler = c8e_CPU::Op_Nop; // 0nnn machine code routines are ignored
+				if (_Y(opcode) == 0x0e)
+				{
+					if (_N(opcode) == 0x00) { op.handler = c8e_CPU::Op_ClearScreen; }
+					else if (_N(opcode) == 0x0e) { op.handler = c8e_CPU::Op_Return; }
+					else { op.handler = c8e_CPU::Op_Trap; }
+				}
+				break;
+			}
+			case 0x01: { op.handler = c8e_CPU::Op_Jump; break; }
+			case 0x02: { op.handler = c8e_CPU::Op_Call; break; }
+			case 0x03: { op.handler = c8e_CPU::Op_SkipEqualImm; break; }
+			case 0x04: { op.handler = c8e_CPU::Op_SkipNotEqualImm; break; }
+			case 0x05: { op.handler = c8e_CPU::Op_SkipEqual; break; }
+			case 0x09: { op.handler = c8e_CPU::Op_SkipNotEqual; break; }
+			case 0x06: { op.handler = c8e_CPU::Op_SetImm; break; }
+			case 0x07: { op.handler = c8e_CPU::Op_AddImm; break; }
+			case 0x08:
+			{
+				switch (_N(opcode))
+				{
+					case 0x00: { op.handler = c8e_CPU::Op_Set; break; }
+					case 0x01: { op.handler = c8e_CPU::Op_Or; break; }
+					case 0x02: { op.handler = c8e_CPU::Op_And; break; }
+					case 0x03: { op.handler = c8e_CPU::Op_Xor; break; }
+					case 0x04: { op.handler = c8e_CPU::Op_Add; break; }
+					case 0x05: { op.handler = c8e_CPU::Op_Sub; break; }
+					case 0x07: { op.handler = c8e_CPU::Op_SubReverse; break; }
+					case 0x06: { op.handler = c8e_CPU::Op_ShiftRight; break; }
+					case 0x0e: { op.handler = c8e_CPU::Op_ShiftLeft; break; }
+				}
+				break;
+			}
+			case 0x0a: { op.handler = c8e_CPU::Op_SetIndex; break; }
+			case 0x0b: { op.handler = c8e_CPU::Op_JumpOffset; break; }
+			case 0x0c: { op.handler = c8e_CPU::Op_Random; break; }
+			case 0x0d: { op.handler = c8e_CPU::Op_Display; break; }
+			case 0x0e:
+			{
+				switch (_NN(opcode))
+				{
+					case 0x9e: { op.handler = c8e_CPU::Op_SkipKey; break; }
+					case 0xa1: { op.handler = c8e_CPU::Op_SkipNotKey; break; }
+				}
+				break;
+			}
+			case 0x0f:
+			{
+				switch (_NN(opcode))
+				{
+					case 0x07: { op.handler = c8e_CPU::Op_ReadDelay; break; }
+					case 0x15: { op.handler = c8e_CPU::Op_SetDelay; break; }
+					case 0x18: { op.handler = c8e_CPU::Op_SetSound; break; }
+					case 0x0a: { op.handler = c8e_CPU::Op_WaitKey; break; }
+					case 0x1e: { op.handler = c8e_CPU::Op_AddIndex; break; }
+					case 0x29: { op.handler = c8e_CPU::Op_FontChar; break; }
+					case 0x33: { op.handler = c8e_CPU::Op_BCD; break; }
+					case 0x55: { op.handler = c8e_CPU::Op_Store; break; }
+					case 0x65: { op.handler = c8e_CPU::Op_Load; break; }
+				}
+				break;
+			}
+		}
+		return op;
+	}
+};
+
+static constexpr c8e_OpTable s_opTable;
 
-	m_stack = (u16**)calloc(STACK_SIZE, sizeof(u16*));
-	m_stackIdx = 0;
+c8e_CPU::c8e_CPU(const char* romName, int engine)
+{
+	m_engine = engine;
 
-	m_V = (u8*)calloc(NUM_REGISTERS, sizeof(u16));
+	m_state.pc = PROGRAM_OFFSET;
+	m_state.random = DEFAULT_SEED;
 
 	InitFont();
 
-	m_renderData = (bool*)calloc((WIDTH_PIXELS * HEIGHT_PIXELS), sizeof(bool));
+	m_sprites = (c8e_SpriteMask*)calloc(SPRITE_CACHE_SIZE, sizeof(c8e_SpriteMask));
+	m_spriteMap = (u8*)calloc(RAM_SIZE, sizeof(u8));
+
+	m_blocks = (c8e_Block**)calloc(RAM_SIZE, sizeof(c8e_Block*));
+	m_codeMap = (u8*)calloc(RAM_SIZE, sizeof(u8));
+
+	if (m_engine == ENGINE_JIT)
+	{
+#if defined(JIT_SUPPORTED)
+		m_jit = new c8e_JIT(this);
+		if (!m_jit->IsReady())
+		{
+			delete m_jit;
+			m_jit = NULL;
+		}
+#endif
+		if (!m_jit)
+		{
+			m_engine = ENGINE_BLOCK;
+		}
+	}
+
+	LoadRom(romName);
 
-	LoadRom();
+	if (m_engine == ENGINE_STATIC)
+	{
+		m_aot = c8e_AOT::Find(m_state.ram + PROGRAM_OFFSET, m_romSize);
+		if (!m_aot)
+		{
+			m_engine = ENGINE_BLOCK;
+		}
+		else
+		{
+			// mark the translated code so stores over it are noticed
+			for (int i = 0; i < m_aot->codeRanges; i++)
+			{
+				for (int address = m_aot->code[i * 2]; address < m_aot->code[i * 2 + 1]; address++)
+				{
+					m_codeMap[address] = 1;
+				}
+			}
+		}
+	}
 }
 
 void c8e_CPU::InitFont()
@@ -54,388 +193,987 @@ void c8e_CPU::InitFont()
 	};
 	for (int i = 0; i < (16 * FONT_HEIGHT); i++)
 	{
-		m_ram[FONT_OFFSET + i] = fontData[i];
+		m_state.ram[FONT_OFFSET + i] = fontData[i];
 	}
 }
 
-void c8e_CPU::LoadRom()
+void c8e_CPU::LoadRom(const char* romName)
 {
-	//const char* romName = "IBMLogo.ch8";
-	//const char* romName = "bc_test.ch8";
-	const char* romName = "test_opcode.ch8";
-	//const char* romName = "rockto.ch8";
-	//const char* romName = "RPS.ch8";
-	//const char* romName = "cavern.ch8";
-	//const char* romName = "chipquarium.ch8";
-	//const char* romName = "Breakout.ch8";
 	std::ifstream file(romName, std::ios::binary | std::ios::ate);
 	file.seekg(0, std::ios::end);
 	std::streamsize size = file.tellg();
 	file.seekg(0, std::ios::beg);
 
-	file.read((char*)m_ram + PROGRAM_OFFSET, size);
+	if (size > RAM_SIZE - PROGRAM_OFFSET)
+	{
+		size = RAM_SIZE - PROGRAM_OFFSET;
+	}
+	file.read((char*)m_state.ram + PROGRAM_OFFSET, size);
+	m_romSize = (int)file.gcount();
+
+	m_romChecksum = 2166136261u;
+	for (int i = 0; i < m_romSize; i++)
+	{
+		m_romChecksum = (m_romChecksum ^ m_state.ram[PROGRAM_OFFSET + i]) * 16777619u;
+	}
 }
 
 c8e_CPU::~c8e_CPU()
 {
-	free(m_ram);
-	free(m_stack);
-	free(m_V);
-	free(m_renderData);
-}
+	free(m_sprites);
+	free(m_spriteMap);
 
-bool c8e_CPU::AdvanceTime()
-{
-	std::chrono::time_point<std::chrono::system_clock> now = std::chrono::system_clock::now();
-	double dt = (double)((now - m_prevDelta) / std::chrono::microseconds(1));
-	m_prevDelta = now;
+	for (int i = 0; i < RAM_SIZE; i++)
+	{
+		free(m_blocks[i]);
+	}
+	free(m_blocks);
+	free(m_codeMap);
 
-	double clockTick = 1000000 / m_clockspeed;
-	double timerTick = 1000000 / m_timerspeed;
+#if defined(JIT_SUPPORTED)
+	delete m_jit;
+#endif
+}
 
-	m_clockCount += dt;
-	m_timerCount += dt;
+int c8e_CPU::StepInstructions(int count)
+{
+	m_events = EVENT_NONE;
 
-	if (m_clockCount >= clockTick)
+	// split the run at queued key changes so each one lands on its own cycle
+	while (count > 0)
 	{
-		// execute instruction cycle
-		m_clockCount = fmod(m_clockCount, clockTick);
-
-		u16 opcode = Fetch();
-		Decode(opcode);
-	}
+		ApplyKeys();
+		int run = count;
+		if (m_keyTail != m_keyHead)
+		{
+			u64 until = m_keyQueue[m_keyTail & (KEY_EVENT_QUEUE - 1)].cycle - m_state.cycleCount;
+			if (until < (u64)run)
+			{
+				run = (int)until;
+			}
+		}
 
-	if (m_timerCount >= timerTick)
-	{
-		// update timers
-		m_timerCount = fmod(m_timerCount, timerTick);
-		if (m_delayCount)
+		// idle loops only advance the clock, so their cycles are added without running them
+		int lead = 0;
+		int idle = IdleCycles(run, lead);
+		if (idle > 0)
 		{
-			m_delayCount--;
+			AddCycles(idle);
+			m_idleCycles += idle;
+			m_events |= EVENT_IDLE;
+			count -= idle;
+			continue;
 		}
-		if (m_soundCount)
+		if (lead > 0 && lead < run)
 		{
-			m_soundCount--;
+			run = lead; // inside a delay loop, run up to its start so the rest can be skipped
 		}
-		return true; // Only render 60 times a second
+
+		RunEngine(run);
+		count -= run;
 	}
-	else
+	ApplyKeys();
+
+	if (m_audio)
 	{
-		return false;
+		m_audio->Sync(m_state.cycleCount, m_clockspeed);
 	}
+	return m_events;
 }
 
-u16 c8e_CPU::Fetch()
+void c8e_CPU::QueueKey(c8e_KeyEvent event)
 {
-	// get instruction at program counter
-	u16 val = *m_pc;
+	m_keyEvents++;
+	event.key &= 0x0f;
 
-	// advance program counter
-	m_pc += 1;
+	// events already in the past land on the next instruction, and the queue stays in cycle order
+	if (event.cycle < m_state.cycleCount)
+	{
+		m_keyLateCycles += m_state.cycleCount - event.cycle;
+		event.cycle = m_state.cycleCount;
+	}
+	if (m_keyTail != m_keyHead)
+	{
+		u64 last = m_keyQueue[(m_keyHead - 1) & (KEY_EVENT_QUEUE - 1)].cycle;
+		if (event.cycle < last)
+		{
+			event.cycle = last;
+		}
+	}
 
-	// return instruction
-	return val;
+	// when full the oldest change takes effect early rather than being lost
+	if (m_keyHead - m_keyTail == KEY_EVENT_QUEUE)
+	{
+		ApplyKey(m_keyQueue[m_keyTail & (KEY_EVENT_QUEUE - 1)]);
+		m_keyTail++;
+	}
+	m_keyQueue[m_keyHead & (KEY_EVENT_QUEUE - 1)] = event;
+	m_keyHead++;
 }
 
-#define _INSTRUCTION(val) ((val >> 4) & 0x0f)
-#define _X(val) ((val >> 0) & 0x0f)
-#define _Y(val) ((val >> 12)  & 0x0f)
-#define _N(val) ((val >> 8) & 0x0f)
-#define _NN(val) ((_Y(val) << 4) | _N(val))
-#define _NNN(val) ((_X(val) << 8) | (_Y(val) << 4) | _N(val))
-#define _VF (m_V[0x0f])
-
-void c8e_CPU::Decode(u16 opcode)
+void c8e_CPU::ApplyKeys()
 {
-	switch (_INSTRUCTION(opcode))
+	while (m_keyTail != m_keyHead)
 	{
-		case 0x00:
-		{
-			if (_Y(opcode) == 0x0e)
-			{
-				if (_N(opcode) == 0x00) // Clear Screen
-				{
-					ClearScreen();
-				}
-				else if (_N(opcode) == 0x0e) // Subroutine return (pop)
-				{
-					m_stackIdx -= 1;
-					m_pc = m_stack[m_stackIdx];
-				}
-				else
-				{
-					assert(true); // unhandled instruction!
-				}
-			}
-			break;
-		}
-		case 0x01: // Jump
+		const c8e_KeyEvent& event = m_keyQueue[m_keyTail & (KEY_EVENT_QUEUE - 1)];
+		if (event.cycle > m_state.cycleCount)
 		{
-			m_pc = (u16*)(m_ram + _NNN(opcode));
 			break;
 		}
-		case 0x02: // Call Subroutine (push)
+		ApplyKey(event);
+		m_keyTail++;
+	}
+}
+
+void c8e_CPU::SetKeys(u16 keys)
+{
+	for (int key = 0; key < NUM_KEYS; key++)
+	{
+		bool down = (keys >> key) & 1;
+		if (m_state.input[key] != down)
 		{
-			m_stack[m_stackIdx] = m_pc;
-			m_stackIdx += 1;
-			m_pc = (u16*)&m_ram[_NNN(opcode)];
-			break;
+			c8e_KeyEvent event;
+			event.cycle = m_state.cycleCount;
+			event.key = (u8)key;
+			event.down = down;
+			ApplyKey(event);
 		}
-		case 0x03: // Skip if equal to immediate
+	}
+}
+
+void c8e_CPU::ApplyKey(const c8e_KeyEvent& event)
+{
+	m_state.input[event.key] = event.down;
+	if (m_movie)
+	{
+		m_movie->RecordKey(m_state.cycleCount, event.key, event.down);
+	}
+}
+
+int c8e_CPU::IdleCycles(int count, int& lead)
+{
+	const u8* ram = m_state.ram;
+	u16 pc = m_state.pc;
+
+	// 1nnn jumping to itself never gets anywhere, it is treated as the end of the program
+	if ((ram[pc] & 0xf0) == 0x10 && (((ram[pc] & 0x0f) << 8) | ram[(pc + 1) & RAM_MASK]) == pc)
+	{
+		m_events |= EVENT_HALT;
+		return count;
+	}
+
+	// Fx0A with no key down repeats itself until the next key change, which always starts a new run
+	if ((ram[pc] & 0xf0) == 0xf0 && ram[(pc + 1) & RAM_MASK] == 0x0a)
+	{
+		for (int i = 0; i < NUM_KEYS; i++)
 		{
-			if (m_V[_X(opcode)] == _NN(opcode))
+			if (m_state.input[i])
 			{
-				m_pc += 1;
+				return 0;
 			}
-			break;
 		}
-		case 0x04: // Skip if not equal to immediate
+		m_events |= EVENT_WAITKEY;
+		return count;
+	}
+
+	// Fx07, 3xkk, 1nnn back to the Fx07 waits for the delay timer to reach kk
+	for (int offset = 0; offset <= 4; offset += 2)
+	{
+		u16 start = (pc - offset) & RAM_MASK;
+		const u8 read[2] = { ram[start], ram[(start + 1) & RAM_MASK] };
+		const u8 test[2] = { ram[(start + 2) & RAM_MASK], ram[(start + 3) & RAM_MASK] };
+		const u8 jump[2] = { ram[(start + 4) & RAM_MASK], ram[(start + 5) & RAM_MASK] };
+		if ((read[0] & 0xf0) != 0xf0 || read[1] != 0x07 || test[0] != (0x30 | (read[0] & 0x0f))
+			|| (jump[0] & 0xf0) != 0x10 || (((jump[0] & 0x0f) << 8) | jump[1]) != start)
 		{
-			if (m_V[_X(opcode)] != _NN(opcode))
-			{
-				m_pc += 1;
-			}
-			break;
+			continue;
 		}
-		case 0x05: // Skip if registers are equal
+		if (offset)
 		{
-			if (m_V[_X(opcode)] == m_V[_Y(opcode)])
-			{
-				m_pc += 1;
-			}
-			break;
+			lead = (6 - offset) / 2;
+			return 0;
 		}
-		case 0x09: // Skip if registers are not equal
+
+		// iteration i reads the delay timer after ticks(3i) = (timerCount + 3i * timerspeed) / clockspeed ticks
+		u64 delay = m_state.delay;
+		u64 target = test[1];
+		u64 iterations = (u64)(count / 3);
+		if (target == delay)
 		{
-			if (m_V[_X(opcode)] != m_V[_Y(opcode)])
-			{
-				m_pc += 1;
-			}
-			break;
+			return 0; // leaves the loop this time round
 		}
-		case 0x06: // Set
+		if (target < delay)
 		{
-			m_V[_X(opcode)] = _NN(opcode);
-			break;
+			// stop before the first iteration that can read target
+			u64 ticks = delay - target;
+			u64 step = 3 * (u64)m_timerspeed;
+			u64 exit = (ticks * m_clockspeed - m_state.timerCount + step - 1) / step;
+			iterations = (exit < iterations) ? exit : iterations;
 		}
-		case 0x07: // Add
+		if (iterations == 0)
+		{
+			return 0;
+		}
+
+		// the last skipped iteration leaves the value it read in Vx
+		u64 ticks = ((u64)m_state.timerCount + 3 * (iterations - 1) * m_timerspeed) / m_clockspeed;
+		m_state.V[read[0] & 0x0f] = (u8)((ticks < delay) ? delay - ticks : 0);
+		return (int)(iterations * 3);
+	}
+	return 0;
+}
+
+void c8e_CPU::RunEngine(int count)
+{
+	switch (m_engine)
+	{
+		case ENGINE_BLOCK:
 		{
-			m_V[_X(opcode)] += _NN(opcode);
+			RunBlocks(count);
 			break;
 		}
-		case 0x08: // Arithmetic instructions
+		case ENGINE_THREADED:
 		{
-			switch (_N(opcode))
-			{
-				case 0x00: // Set
-				{
-					m_V[_X(opcode)] = m_V[_Y(opcode)];
-					break;
-				}
-				case 0x01: // OR
-				{
-					m_V[_X(opcode)] = m_V[_X(opcode)] | m_V[_Y(opcode)];
-					break;
-				}
-				case 0x02: // AND
-				{
-					m_V[_X(opcode)] = m_V[_X(opcode)] & m_V[_Y(opcode)];
-					break;
-				}
-				case 0x03: // XOR
-				{
-					m_V[_X(opcode)] = m_V[_X(opcode)] ^ m_V[_Y(opcode)];
-					break;
-				}
-				case 0x04: // Add
-				{
-					u8 val = m_V[_X(opcode)] + m_V[_Y(opcode)];
-					_VF = (val < m_V[_X(opcode)]) || (val < m_V[_Y(opcode)]);
-					m_V[_X(opcode)] = val;
-					break;
-				}
-				case 0x05: // Subtraction (X - Y)
-				{
-					_VF = (m_V[_X(opcode)] >= m_V[_Y(opcode)]);
-					m_V[_X(opcode)] = m_V[_X(opcode)] - m_V[_Y(opcode)];
-					break;
-				}
-				case 0x07: // Subtraction (Y - X)
-				{
-					_VF = (m_V[_Y(opcode)] >= m_V[_X(opcode)]);
-					m_V[_X(opcode)] = m_V[_Y(opcode)] - m_V[_X(opcode)];
-					break;
-				}
-				case 0x06: // Shift right
-				{
-					_VF = m_V[_X(opcode)] & 0x01;
-					m_V[_X(opcode)] = m_V[_X(opcode)] >> 1;
-					break;
-				}
-				case 0x0e: // Shift left
-				{
-					_VF = (m_V[_X(opcode)] & 0x80) > 0;
-					m_V[_X(opcode)] = m_V[_X(opcode)] << 1;
-					break;
-				}
-				default:
-				{
-					assert(true); // unhandled instruction!
-					break;
-				}
-			}
+			RunThreaded(count);
 			break;
 		}
-		case 0x0a: // Set index
+		case ENGINE_TABLE:
 		{
-			m_I = m_ram + _NNN(opcode);
+			RunTable(count);
 			break;
 		}
-		case 0x0b: // Jump with offset
+		case ENGINE_STATIC:
 		{
-			m_pc = (u16*)m_ram[_NNN(opcode) + m_V[0]];
+			RunStatic(count);
 			break;
 		}
-		case 0x0c: // Random
+#if defined(JIT_SUPPORTED)
+		case ENGINE_JIT:
 		{
-			u16 rnd = rand() % 256;
-			m_V[_X(opcode)] = rnd & _NN(opcode);
+			m_jit->Run(count);
 			break;
 		}
-		case 0x0d: // Display
+#endif
+		default:
 		{
-			int _x = m_V[_X(opcode)] % WIDTH_PIXELS;
-			int _y = m_V[_Y(opcode)] % HEIGHT_PIXELS;
-			u8* _i = m_I;
-			bool setFlag = false;
-
-			for (int y = 0; y < _N(opcode); y++)
-			{
-				int currentY = _y + y;
-				if (currentY >= HEIGHT_PIXELS) { break; }
-				u8 drawMask = 0x80;
-				for (int x = 0; x < 8; x++)
-				{
-					int currentX = _x + x;
-					if (currentX >= WIDTH_PIXELS) { break; }
-					if (_i[y] & drawMask)
-					{
-						int renderPos = currentX + (currentY * WIDTH_PIXELS);
-						m_renderData[renderPos] = !m_renderData[renderPos];
-						if (!m_renderData[renderPos])
-						{
-							setFlag = true;
-						}
-					}
-					drawMask = (drawMask >> 1);
-				}
-			}
-			_VF = setFlag;
+			RunSwitch(count);
 			break;
 		}
-		case 0x0e: // Skip based on input
+	}
+}
+
+int c8e_CPU::RunFrame(int ipf)
+{
+	// run the emulated clock at ipf instructions per frame, up to and including the next timer tick
+	m_clockspeed = ipf * m_timerspeed;
+	if (m_state.timerCount >= m_clockspeed)
+	{
+		m_state.timerCount = 0;
+	}
+	int cycles = (m_clockspeed - m_state.timerCount + m_timerspeed - 1) / m_timerspeed;
+	return StepInstructions(cycles);
+}
+
+void c8e_CPU::TickTimers(u64 cycle)
+{
+	if (m_state.delay)
+	{
+		m_state.delay--;
+	}
+	if (m_state.sound)
+	{
+		m_state.sound--;
+		if (!m_state.sound)
 		{
-			switch (_NN(opcode))
+			m_events |= EVENT_SOUND;
+			if (m_audio)
 			{
-				case 0x9e: // Skip if key pressed
-				{
-					if (m_input[m_V[_X(opcode)]])
-					{
-						m_pc += 1;
-					}
-					break;
-				}
-				case 0xa1: // Skip if key not pressed
-				{
-					if (!m_input[m_V[_X(opcode)]])
-					{
-						m_pc += 1;
-					}
-					break;
-				}
-				default:
-				{
-					assert(true); // unhandled instruction!
-					break;
-				}
+				m_audio->PushEdge(cycle, false);
 			}
-			break;
 		}
-		case 0x0f: // Miscellaneous
+	}
+	m_events |= EVENT_FRAME;
+}
+
+void c8e_CPU::SetSoundTimer(u8 value, u64 cycle)
+{
+	if ((m_state.sound > 0) != (value > 0))
+	{
+		m_events |= EVENT_SOUND;
+		if (m_audio)
 		{
-			switch (_NN(opcode))
+			m_audio->PushEdge(cycle, value > 0);
+		}
+	}
+	m_state.sound = value;
+}
+
+void c8e_CPU::AddCycles(int cycles)
+{
+	m_state.cycleCount += cycles;
+
+	// timers run at m_timerspeed against an emulated clock of m_clockspeed, a skipped idle stretch can pass
+	// many ticks and each one goes back to its own cycle, the count left over says how far past it we are
+	long long timerCount = m_state.timerCount + (long long)cycles * m_timerspeed;
+	while (timerCount >= m_clockspeed)
+	{
+		timerCount -= m_clockspeed;
+		TickTimers(m_state.cycleCount - timerCount / m_timerspeed);
+	}
+	m_state.timerCount = (int)timerCount;
+}
+
+int c8e_CPU::CyclesUntilTimer()
+{
+	return (m_clockspeed - m_state.timerCount + m_timerspeed - 1) / m_timerspeed;
+}
+
+void c8e_CPU::RunSwitch(int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		u16 opcode = Fetch();
+		DecodeSwitch(opcode);
+		AddCycles(1);
+	}
+}
+
+void c8e_CPU::RunTable(int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		u16 opcode = Fetch();
+		Decode(opcode);
+		AddCycles(1);
+	}
+}
+
+void c8e_CPU::RunBlocks(int count)
+{
+	int untilTimer = CyclesUntilTimer();
+	while (count > 0)
+	{
+		int address = m_state.pc;
+		if (address > RAM_SIZE - 2)
+		{
+			// instruction wraps around the end of ram, leave it to the switch interpreter
+			RunSwitch(1);
+			count--;
+			untilTimer = CyclesUntilTimer();
+			continue;
+		}
+
+		c8e_Block* block = m_blocks[address];
+		if (!block || !block->valid)
+		{
+			block = BuildBlock((u16)address);
+		}
+
+		// stop early on the budget or a timer tick, the rest of the block is picked up next time
+		int run = block->length;
+		if (run > count)
+		{
+			run = count;
+		}
+		if (run > untilTimer)
+		{
+			run = untilTimer;
+		}
+
+		const c8e_Op* op = block->ops;
+		if (run == block->length)
+		{
+			// only the final op of a block reads or writes the program counter
+			const c8e_Op* last = op + block->count - 1;
+			for (; op < last; op++)
 			{
-				case 0x07: // Read delay timer
+				op->handler(this, *op);
+			}
+			m_state.pc = (address + run * 2) & RAM_MASK;
+			op->handler(this, *op);
+		}
+		else
+		{
+			// whole ops up to the cut, then single instructions so no fused op is split
+			int done = 0;
+			for (; done + op->length <= run; op++)
+			{
+				done += op->length;
+				op->handler(this, *op);
+			}
+			m_state.pc = (address + done * 2) & RAM_MASK;
+			for (; done < run; done++)
+			{
+				Decode(Fetch());
+			}
+		}
+
+		count -= run;
+		untilTimer -= run;
+		m_state.cycleCount += run;
+		m_state.timerCount += run * m_timerspeed;
+		if (untilTimer == 0)
+		{
+			m_state.timerCount -= m_clockspeed;
+			TickTimers(m_state.cycleCount);
+			untilTimer = CyclesUntilTimer();
+		}
+	}
+}
+
+void c8e_CPU::RunStatic(int count)
+{
+	int untilTimer = CyclesUntilTimer();
+	while (count > 0)
+	{
+		int budget = (count < untilTimer) ? count : untilTimer;
+		int executed = budget - m_aot->run(this, budget);
+		if (executed == 0)
+		{
+			// untranslated or overwritten code, or a block longer than the budget left
+			Decode(Fetch());
+			executed = 1;
+		}
+
+		count -= executed;
+		untilTimer -= executed;
+		m_state.cycleCount += executed;
+		m_state.timerCount += executed * m_timerspeed;
+		if (untilTimer == 0)
+		{
+			m_state.timerCount -= m_clockspeed;
+			TickTimers(m_state.cycleCount);
+			untilTimer = CyclesUntilTimer();
+		}
+	}
+}
+
+c8e_Block* c8e_CPU::BuildBlock(u16 address)
+{
+	c8e_Block* block = m_blocks[address];
+	if (!block)
+	{
+		block = (c8e_Block*)malloc(sizeof(c8e_Block));
+		m_blocks[address] = block;
+	}
+
+	block->start = address;
+	block->length = 0;
+	u16 pc = address;
+	while (block->length < BLOCK_MAX_OPS && pc <= RAM_SIZE - 2)
+	{
+		c8e_Op op = s_opTable.ops[*(u16*)(m_state.ram + pc)];
+		if (block->length > 0 && StartsBlock(op.handler))
+		{
+			break;
+		}
+		block->ops[block->length++] = op;
+		m_codeMap[pc] = 1;
+		m_codeMap[pc + 1] = 1;
+		pc += 2;
+		if (EndsBlock(op.handler))
+		{
+			break;
+		}
+	}
+	block->next = pc;
+	block->valid = true;
+	FuseOps(block);
+	return block;
+}
+
+void c8e_CPU::FuseOps(c8e_Block* block)
+{
+	// Pairs and runs picked from profiling the bundled roms, as a share of all instructions executed:
+	//   8xyE 8xyE (8xyE)    rockto 18%    Fx07 4xnn    chipquarium 8%
+	//   Annn Fx1E           rockto 3%     7xnn 3xnn    RPS 5%
+	//   6xnn 6ynn, Annn Fx65 before draws and table reads in most roms
+	// Blocks are keyed by start address, so a jump into the middle of a sequence builds its own unfused block.
+	c8e_Op* ops = block->ops;
+	int count = 0;
+	int i = 0;
+	while (i < block->length)
+	{
+		c8e_Op op = ops[i];
+		int left = block->length - i;
+		if (left >= 2)
+		{
+			const c8e_Op& next = ops[i + 1];
+			if (op.handler == Op_ShiftLeft && next.handler == Op_ShiftLeft && op.x == next.x && op.x != 0x0f)
+			{
+				int shifts = 1;
+				while (shifts < left && shifts < 8 && ops[i + shifts].handler == Op_ShiftLeft && ops[i + shifts].x == op.x)
 				{
-					m_V[_X(opcode)] = m_delayCount;
-					break;
+					shifts++;
 				}
-				case 0x15: // Set delay timer
+				op.handler = Op_ShiftLeftN;
+				op.n = (u8)shifts;
+				op.length = (u8)shifts;
+			}
+			else if (op.handler == Op_SetImm && next.handler == Op_SetImm)
+			{
+				op.handler = Op_SetImmPair;
+				op.y = next.x;
+				op.nnn = next.nn;
+				op.length = 2;
+			}
+			else if (op.handler == Op_SetIndex && next.handler == Op_AddIndex)
+			{
+				op.handler = Op_SetIndexAdd;
+				op.x = next.x;
+				op.length = 2;
+			}
+			else if (op.handler == Op_SetIndex && next.handler == Op_Load)
+			{
+				op.handler = Op_SetIndexLoad;
+				op.x = next.x;
+				op.length = 2;
+			}
+			else if ((op.handler == Op_AddImm || op.handler == Op_ReadDelay) && op.x == next.x
+				&& (next.handler == Op_SkipEqualImm || next.handler == Op_SkipNotEqualImm))
+			{
+				op.handler = (op.handler == Op_AddImm) ? Op_AddImmSkip : Op_ReadDelaySkip;
+				op.nnn = next.nn; // compared value
+				op.n = (next.handler == Op_SkipEqualImm); // skip on equal, otherwise on not equal
+				op.length = 2;
+			}
+		}
+		ops[count++] = op;
+		i += op.length;
+	}
+	block->count = count;
+}
+
+void c8e_CPU::InvalidateCode(int address, int length)
+{
+	// called after every store to ram, a store that runs off the end wraps to the start
+	int end = address + length;
+	if (end > RAM_SIZE)
+	{
+		InvalidateCode(0, end - RAM_SIZE);
+		end = RAM_SIZE;
+	}
+	InvalidateSprites(address, end);
+
+	bool hit = false;
+	for (int i = address; i < end; i++)
+	{
+		if (m_codeMap[i])
+		{
+			m_codeMap[i] = 0;
+			hit = true;
+		}
+	}
+	if (!hit)
+	{
+		return;
+	}
+	m_codeWrites++;
+
+	// any block starting less than BLOCK_MAX_OPS instructions before the write may cover it
+	int first = address - (BLOCK_MAX_OPS * 2 - 1);
+	if (first < 0)
+	{
+		first = 0;
+	}
+	for (int i = first; i < end; i++)
+	{
+		c8e_Block* block = m_blocks[i];
+		if (block && block->valid && block->next > address)
+		{
+			block->valid = false;
+		}
+	}
+
+#if defined(JIT_SUPPORTED)
+	if (m_jit)
+	{
+		m_jit->Invalidate(address, end);
+	}
+#endif
+}
+
+void c8e_CPU::SetState(const c8e_State& state)
+{
+	// only the runs of ram that differ lose their decoded blocks and sprites, usually none, so whole cache lines are compared first
+	for (int line = 0; line < RAM_SIZE; line += 64)
+	{
+		if (memcmp(m_state.ram + line, state.ram + line, 64) == 0)
+		{
+			continue;
+		}
+		int i = line;
+		while (i < line + 64)
+		{
+			if (m_state.ram[i] == state.ram[i])
+			{
+				i++;
+				continue;
+			}
+			int start = i;
+			while (i < line + 64 && m_state.ram[i] != state.ram[i])
+			{
+				i++;
+			}
+			InvalidateCode(start, i - start);
+		}
+	}
+
+	if (m_audio)
+	{
+		m_audio->Restart(state.cycleCount, state.sound > 0);
+	}
+
+	m_state = state;
+	m_dirtyRows = 0xffffffff;
+}
+
+void c8e_CPU::BeginSpeculation()
+{
+	m_speculationState = m_state;
+	m_speculationKeyTail = m_keyTail; // applied key changes stay in the queue until the tail moves past them
+	m_speculationDirtyRows = m_dirtyRows;
+	m_speculationAudio = m_audio;
+	m_speculationMovie = m_movie;
+	m_audio = NULL;
+	m_movie = NULL;
+}
+
+void c8e_CPU::EndSpeculation()
+{
+	SetState(m_speculationState);
+	m_keyTail = m_speculationKeyTail;
+	m_dirtyRows = m_speculationDirtyRows;
+	m_audio = m_speculationAudio;
+	m_movie = m_speculationMovie;
+}
+
+size_t c8e_CPU::SaveState(u8* buffer, size_t size)
+{
+	if (size < STATE_BLOB_SIZE)
+	{
+		return 0;
+	}
+
+	c8e_StateHeader header;
+	header.magic = STATE_MAGIC;
+	header.version = STATE_VERSION;
+	header.headerSize = sizeof(c8e_StateHeader);
+	header.stateSize = sizeof(c8e_State);
+	header.clockspeed = m_clockspeed;
+	memcpy(buffer, &header, sizeof(header));
+	memcpy(buffer + sizeof(header), &m_state, sizeof(c8e_State));
+	return STATE_BLOB_SIZE;
+}
+
+bool c8e_CPU::LoadState(const u8* buffer, size_t size)
+{
+	c8e_StateHeader header;
+	if (size < sizeof(header))
+	{
+		return false;
+	}
+	memcpy(&header, buffer, sizeof(header));
+	if (header.magic != STATE_MAGIC || header.version != STATE_VERSION || header.headerSize != sizeof(c8e_StateHeader)
+		|| header.stateSize != sizeof(c8e_State) || size < STATE_BLOB_SIZE || header.clockspeed <= 0)
+	{
+		return false;
+	}
+
+	// the blob may come from another host, so anything used as an index is forced back into range
+	c8e_State state;
+	memcpy(&state, buffer + sizeof(header), sizeof(c8e_State));
+	state.pc &= RAM_MASK;
+	state.I &= RAM_MASK;
+	state.sp &= STACK_SIZE - 1;
+	state.random = state.random ? state.random : DEFAULT_SEED;
+	for (int i = 0; i < STACK_SIZE; i++)
+	{
+		state.stack[i] &= RAM_MASK;
+	}
+	if (state.timerCount < 0 || state.timerCount >= header.clockspeed)
+	{
+		state.timerCount = 0;
+	}
+
+	// pending key changes keep their distance from the current cycle
+	for (u32 i = m_keyTail; i != m_keyHead; i++)
+	{
+		c8e_KeyEvent& event = m_keyQueue[i & (KEY_EVENT_QUEUE - 1)];
+		event.cycle = event.cycle - m_state.cycleCount + state.cycleCount;
+	}
+
+	m_clockspeed = header.clockspeed;
+	SetState(state);
+	return true;
+}
+
+u16 c8e_CPU::Fetch()
+{
+	// get instruction at program counter, the second byte wraps like every other address
+	u16 pc = m_state.pc;
+	u16 val = (u16)(m_state.ram[pc] | (m_state.ram[(pc + 1) & RAM_MASK] << 8));
+
+	// advance program counter
+	m_state.pc = (pc + 2) & RAM_MASK;
+
+	// return instruction
+	return val;
+}
+
+void c8e_CPU::Decode(u16 opcode)
+{
+	const c8e_Op& op = s_opTable.ops[opcode];
+	op.handler(this, op);
+}
+
+void c8e_CPU::DecodeSwitch(u16 opcode)
+{
+	switch (_INSTRUCTION(opcode))
+	{
+		case 0x00:
+		{
+			if (_Y(opcode) == 0x0e)
+			{
+				if (_N(opcode) == 0x00) // Clear Screen
 				{
-					m_delayCount = m_V[_X(opcode)];
-					break;
+					ClearScreen();
 				}
-				case 0x18: // Set sound timer
+				else if (_N(opcode) == 0x0e) // Subroutine return (pop)
 				{
-					m_soundCount = m_V[_X(opcode)];
-					break;
+					m_state.pc = Pop();
 				}
-				case 0x0a: // Wait for input
+				else
 				{
-					for (u8 i = 0; i <= 0x0f; i++)
-					{
-						if (m_input[i])
-						{
-							m_V[_X(opcode)] = i;
-							return;
-						}
-					}
-					m_pc -= 1;
-					break;
+					m_events |= EVENT_TRAP; // unhandled instruction!
 				}
-				case 0x1e: // Add to index
+			}
+			break;
+		}
+		case 0x01: // Jump
+		{
+			m_state.pc = _NNN(opcode);
+			break;
+		}
+		case 0x02: // Call Subroutine (push)
+		{
+			Push(m_state.pc);
+			m_state.pc = _NNN(opcode);
+			break;
+		}
+		case 0x03: // Skip if equal to immediate
+		{
+			Skip(m_state.V[_X(opcode)] == _NN(opcode));
+			break;
+		}
+		case 0x04: // Skip if not equal to immediate
+		{
+			Skip(m_state.V[_X(opcode)] != _NN(opcode));
+			break;
+		}
+		case 0x05: // Skip if registers are equal
+		{
+			Skip(m_state.V[_X(opcode)] == m_state.V[_Y(opcode)]);
+			break;
+		}
+		case 0x09: // Skip if registers are not equal
+		{
+			Skip(m_state.V[_X(opcode)] != m_state.V[_Y(opcode)]);
+			break;
+		}
+		case 0x06: // Set
+		{
+			m_state.V[_X(opcode)] = _NN(opcode);
+			break;
+		}
+		case 0x07: // Add
+		{
+			m_state.V[_X(opcode)] += _NN(opcode);
+			break;
+		}
+		case 0x08: // Arithmetic instructions
+		{
+			switch (_N(opcode))
+			{
+				case 0x00: // Set
 				{
-					u8* newAddress = m_I + m_V[_X(opcode)];
-					_VF = newAddress < m_I;
-					m_I = newAddress;
+					m_state.V[_X(opcode)] = m_state.V[_Y(opcode)];
 					break;
 				}
-				case 0x29: // Font character
+				case 0x01: // OR
 				{
-					u8 ch = ((m_V[_X(opcode)] & 0x0F) * FONT_HEIGHT);
-					m_I = m_ram + FONT_OFFSET + ch;
+					m_state.V[_X(opcode)] = m_state.V[_X(opcode)] | m_state.V[_Y(opcode)];
 					break;
 				}
-				case 0x33: // Binary-coded decimal conversion
+				case 0x02: // AND
 				{
-					u8 dec = m_V[_X(opcode)];
-					u8 dec1 = dec / 100;
-					u8 dec2 = (dec % 100) / 10;
-					u8 dec3 = (dec % 10);
-					m_I[0] = dec1;
-					m_I[1] = dec2;
-					m_I[2] = dec3;
+					m_state.V[_X(opcode)] = m_state.V[_X(opcode)] & m_state.V[_Y(opcode)];
+					break;
+				}
+				case 0x03: // XOR
+				{
+					m_state.V[_X(opcode)] = m_state.V[_X(opcode)] ^ m_state.V[_Y(opcode)];
+					break;
+				}
+				case 0x04: // Add
+				{
+					u8 val = m_state.V[_X(opcode)] + m_state.V[_Y(opcode)];
+					_VF = (val < m_state.V[_X(opcode)]) || (val < m_state.V[_Y(opcode)]);
+					m_state.V[_X(opcode)] = val;
+					break;
+				}
+				case 0x05: // Subtraction (X - Y)
+				{
+					_VF = (m_state.V[_X(opcode)] >= m_state.V[_Y(opcode)]);
+					m_state.V[_X(opcode)] = m_state.V[_X(opcode)] - m_state.V[_Y(opcode)];
+					break;
+				}
+				case 0x07: // Subtraction (Y - X)
+				{
+					_VF = (m_state.V[_Y(opcode)] >= m_state.V[_X(opcode)]);
+					m_state.V[_X(opcode)] = m_state.V[_Y(opcode)] - m_state.V[_X(opcode)];
+					break;
+				}
+				case 0x06: // Shift right
+				{
+					_VF = m_state.V[_X(opcode)] & 0x01;
+					m_state.V[_X(opcode)] = m_state.V[_X(opcode)] >> 1;
+					break;
+				}
+				case 0x0e: // Shift left
+				{
+					_VF = (m_state.V[_X(opcode)] & 0x80) > 0;
+					m_state.V[_X(opcode)] = m_state.V[_X(opcode)] << 1;
+					break;
+				}
+				default:
+				{
+					m_events |= EVENT_TRAP; // unhandled instruction!
+					break;
+				}
+			}
+			break;
+		}
+		case 0x0a: // Set index
+		{
+			m_state.I = _NNN(opcode);
+			break;
+		}
+		case 0x0b: // Jump with offset
+		{
+			m_state.pc = (_NNN(opcode) + m_state.V[0]) & RAM_MASK;
+			break;
+		}
+		case 0x0c: // Random
+		{
+			m_state.V[_X(opcode)] = NextRandom() & _NN(opcode);
+			break;
+		}
+		case 0x0d: // Display
+		{
+			DrawSprite(m_state.V[_X(opcode)], m_state.V[_Y(opcode)], _N(opcode));
+			break;
+		}
+		case 0x0e: // Skip based on input
+		{
+			switch (_NN(opcode))
+			{
+				case 0x9e: // Skip if key pressed
+				{
+					Skip(m_state.input[m_state.V[_X(opcode)] & 0x0f]);
+					break;
+				}
+				case 0xa1: // Skip if key not pressed
+				{
+					Skip(!m_state.input[m_state.V[_X(opcode)] & 0x0f]);
+					break;
+				}
+				default:
+				{
+					m_events |= EVENT_TRAP; // unhandled instruction!
+					break;
+				}
+			}
+			break;
+		}
+		case 0x0f: // Miscellaneous
+		{
+			switch (_NN(opcode))
+			{
+				case 0x07: // Read delay timer
+				{
+					m_state.V[_X(opcode)] = m_state.delay;
+					break;
+				}
+				case 0x15: // Set delay timer
+				{
+					m_state.delay = m_state.V[_X(opcode)];
+					break;
+				}
+				case 0x18: // Set sound timer
+				{
+					SetSoundTimer(m_state.V[_X(opcode)], m_state.cycleCount);
+					break;
+				}
+				case 0x0a: // Wait for input
+				{
+					for (u8 i = 0; i <= 0x0f; i++)
+					{
+						if (m_state.input[i])
+						{
+							m_state.V[_X(opcode)] = i;
+							return;
+						}
+					}
+					m_state.pc = (m_state.pc - 2) & RAM_MASK;
+					m_events |= EVENT_WAITKEY;
+					break;
+				}
+				case 0x1e: // Add to index
+				{
+					// I wraps inside ram instead of overflowing, so VF is always cleared
+					m_state.I = (m_state.I + m_state.V[_X(opcode)]) & RAM_MASK;
+					_VF = 0;
+					break;
+				}
+				case 0x29: // Font character
+				{
+					u8 ch = ((m_state.V[_X(opcode)] & 0x0F) * FONT_HEIGHT);
+					m_state.I = FONT_OFFSET + ch;
+					break;
+				}
+				case 0x33: // Binary-coded decimal conversion
+				{
+					u8 dec = m_state.V[_X(opcode)];
+					u8 dec1 = dec / 100;
+					u8 dec2 = (dec % 100) / 10;
+					u8 dec3 = (dec % 10);
+					m_state.ram[m_state.I] = dec1;
+					m_state.ram[(m_state.I + 1) & RAM_MASK] = dec2;
+					m_state.ram[(m_state.I + 2) & RAM_MASK] = dec3;
+					InvalidateCode(m_state.I, 3);
 					break;
 				}
 				case 0x55: // Store memory
 				{
 					for (int i = 0; i <= _X(opcode); i++)
 					{
-						m_I[i] = m_V[i];
+						m_state.ram[(m_state.I + i) & RAM_MASK] = m_state.V[i];
 					}
+					InvalidateCode(m_state.I, _X(opcode) + 1);
 					break;
 				}
 				case 0x65: // Load memory
 				{
 					for (int i = 0; i <= _X(opcode); i++)
 					{
-						m_V[i] = m_I[i];
+						m_state.V[i] = m_state.ram[(m_state.I + i) & RAM_MASK];
 					}
 					break;
 				}
 				default:
 				{
-					assert(true); // unhandled instruction!
+					m_events |= EVENT_TRAP; // unhandled instruction!
 					break;
 				}
 			}
@@ -443,16 +1181,639 @@ void c8e_CPU::Decode(u16 opcode)
 		}
 		default:
 		{
-			assert(true); // unhandled instruction!
+			m_events |= EVENT_TRAP; // unhandled instruction!
+			break;
+		}
+	}
+}
+
+#if defined(__GNUC__)
+#define THREADED_DISPATCH() \
+	if (remaining-- == 0) { goto segment_end; } \
+	opcode = (u16)(ram[pc] | (ram[(pc + 1) & RAM_MASK] << 8)); \
+	pc = (pc + 2) & RAM_MASK; \
+	goto *opTable[_INSTRUCTION(opcode)]
+#endif
+
+void c8e_CPU::RunThreaded(int count)
+{
+#if defined(__GNUC__)
+	// every handler ends in its own indirect jump to the next handler, using GCC/Clang labels as values
+	static void* const opTable[16] = {
+		&&op_system, &&op_jump, &&op_call, &&op_skipEqualImm,
+		&&op_skipNotEqualImm, &&op_skipEqual, &&op_setImm, &&op_addImm,
+		&&op_arithmetic, &&op_skipNotEqual, &&op_setIndex, &&op_jumpOffset,
+		&&op_random, &&op_display, &&op_input, &&op_misc
+	};
+	static void* const arithmeticTable[16] = {
+		&&op_set, &&op_or, &&op_and, &&op_xor,
+		&&op_add, &&op_sub, &&op_shiftRight, &&op_subReverse,
+		&&op_trap, &&op_trap, &&op_trap, &&op_trap,
+		&&op_trap, &&op_trap, &&op_shiftLeft, &&op_trap
+	};
+
+	u16 pc = m_state.pc;
+	u8* ram = m_state.ram;
+	u8* V = m_state.V;
+	u16 opcode;
+	int untilTimer = CyclesUntilTimer();
+	int segment;
+	int remaining;
+
+next_segment:
+	if (count == 0)
+	{
+		m_state.pc = pc;
+		return;
+	}
+
+	// run up to the next timer tick without checking timers per instruction
+	segment = (count < untilTimer) ? count : untilTimer;
+	remaining = segment;
+	THREADED_DISPATCH();
+
+op_trap:
+	m_events |= EVENT_TRAP; // unhandled instruction!
+	THREADED_DISPATCH();
+
+op_system:
+	if (_Y(opcode) == 0x0e)
+	{
+		if (_N(opcode) == 0x00) // Clear Screen
+		{
+			ClearScreen();
+		}
+		else if (_N(opcode) == 0x0e) // Subroutine return (pop)
+		{
+			pc = Pop();
+		}
+		else
+		{
+			goto op_trap;
+		}
+	}
+	THREADED_DISPATCH();
+
+op_jump:
+	pc = _NNN(opcode);
+	THREADED_DISPATCH();
+
+op_call:
+	Push(pc);
+	pc = _NNN(opcode);
+	THREADED_DISPATCH();
+
+op_skipEqualImm:
+	pc = (pc + 2 * (V[_X(opcode)] == _NN(opcode))) & RAM_MASK;
+	THREADED_DISPATCH();
+
+op_skipNotEqualImm:
+	pc = (pc + 2 * (V[_X(opcode)] != _NN(opcode))) & RAM_MASK;
+	THREADED_DISPATCH();
+
+op_skipEqual:
+	pc = (pc + 2 * (V[_X(opcode)] == V[_Y(opcode)])) & RAM_MASK;
+	THREADED_DISPATCH();
+
+op_skipNotEqual:
+	pc = (pc + 2 * (V[_X(opcode)] != V[_Y(opcode)])) & RAM_MASK;
+	THREADED_DISPATCH();
+
+op_setImm:
+	V[_X(opcode)] = _NN(opcode);
+	THREADED_DISPATCH();
+
+op_addImm:
+	V[_X(opcode)] += _NN(opcode);
+	THREADED_DISPATCH();
+
+op_arithmetic:
+	goto *arithmeticTable[_N(opcode)];
+
+op_set:
+	V[_X(opcode)] = V[_Y(opcode)];
+	THREADED_DISPATCH();
+
+op_or:
+	V[_X(opcode)] = V[_X(opcode)] | V[_Y(opcode)];
+	THREADED_DISPATCH();
+
+op_and:
+	V[_X(opcode)] = V[_X(opcode)] & V[_Y(opcode)];
+	THREADED_DISPATCH();
+
+op_xor:
+	V[_X(opcode)] = V[_X(opcode)] ^ V[_Y(opcode)];
+	THREADED_DISPATCH();
+
+op_add:
+	{
+		u8 val = V[_X(opcode)] + V[_Y(opcode)];
+		_VF = (val < V[_X(opcode)]) || (val < V[_Y(opcode)]);
+		V[_X(opcode)] = val;
+	}
+	THREADED_DISPATCH();
+
+op_sub:
+	_VF = (V[_X(opcode)] >= V[_Y(opcode)]);
+	V[_X(opcode)] = V[_X(opcode)] - V[_Y(opcode)];
+	THREADED_DISPATCH();
+
+op_subReverse:
+	_VF = (V[_Y(opcode)] >= V[_X(opcode)]);
+	V[_X(opcode)] = V[_Y(opcode)] - V[_X(opcode)];
+	THREADED_DISPATCH();
+
+op_shiftRight:
+	_VF = V[_X(opcode)] & 0x01;
+	V[_X(opcode)] = V[_X(opcode)] >> 1;
+	THREADED_DISPATCH();
+
+op_shiftLeft:
+	_VF = (V[_X(opcode)] & 0x80) > 0;
+	V[_X(opcode)] = V[_X(opcode)] << 1;
+	THREADED_DISPATCH();
+
+op_setIndex:
+	m_state.I = _NNN(opcode);
+	THREADED_DISPATCH();
+
+op_jumpOffset:
+	pc = (_NNN(opcode) + V[0]) & RAM_MASK;
+	THREADED_DISPATCH();
+
+op_random:
+	V[_X(opcode)] = NextRandom() & _NN(opcode);
+	THREADED_DISPATCH();
+
+op_display:
+	DrawSprite(V[_X(opcode)], V[_Y(opcode)], _N(opcode));
+	THREADED_DISPATCH();
+
+op_input:
+	if (_NN(opcode) == 0x9e) // Skip if key pressed
+	{
+		pc = (pc + 2 * m_state.input[V[_X(opcode)] & 0x0f]) & RAM_MASK;
+	}
+	else if (_NN(opcode) == 0xa1) // Skip if key not pressed
+	{
+		pc = (pc + 2 * !m_state.input[V[_X(opcode)] & 0x0f]) & RAM_MASK;
+	}
+	else
+	{
+		goto op_trap;
+	}
+	THREADED_DISPATCH();
+
+op_misc:
+	switch (_NN(opcode))
+	{
+		case 0x07: // Read delay timer
+		{
+			V[_X(opcode)] = m_state.delay;
+			break;
+		}
+		case 0x15: // Set delay timer
+		{
+			m_state.delay = V[_X(opcode)];
+			break;
+		}
+		case 0x18: // Set sound timer
+		{
+			// the segment is only counted at its end, the ones before this have run
+			SetSoundTimer(V[_X(opcode)], m_state.cycleCount + (segment - remaining - 1));
+			break;
+		}
+		case 0x0a: // Wait for input
+		{
+			u8 i = 0;
+			while (i <= 0x0f && !m_state.input[i])
+			{
+				i++;
+			}
+			if (i <= 0x0f)
+			{
+				V[_X(opcode)] = i;
+			}
+			else
+			{
+				pc = (pc - 2) & RAM_MASK;
+				m_events |= EVENT_WAITKEY;
+			}
+			break;
+		}
+		case 0x1e: // Add to index
+		{
+			m_state.I = (m_state.I + V[_X(opcode)]) & RAM_MASK;
+			_VF = 0;
+			break;
+		}
+		case 0x29: // Font character
+		{
+			m_state.I = FONT_OFFSET + ((V[_X(opcode)] & 0x0F) * FONT_HEIGHT);
 			break;
 		}
+		case 0x33: // Binary-coded decimal conversion
+		{
+			u8 dec = V[_X(opcode)];
+			ram[m_state.I] = dec / 100;
+			ram[(m_state.I + 1) & RAM_MASK] = (dec % 100) / 10;
+			ram[(m_state.I + 2) & RAM_MASK] = (dec % 10);
+			InvalidateCode(m_state.I, 3);
+			break;
+		}
+		case 0x55: // Store memory
+		{
+			for (int i = 0; i <= _X(opcode); i++)
+			{
+				ram[(m_state.I + i) & RAM_MASK] = V[i];
+			}
+			InvalidateCode(m_state.I, _X(opcode) + 1);
+			break;
+		}
+		case 0x65: // Load memory
+		{
+			for (int i = 0; i <= _X(opcode); i++)
+			{
+				V[i] = ram[(m_state.I + i) & RAM_MASK];
+			}
+			break;
+		}
+		default:
+		{
+			goto op_trap;
+		}
+	}
+	THREADED_DISPATCH();
+
+segment_end:
+	count -= segment;
+	untilTimer -= segment;
+	m_state.cycleCount += segment;
+	m_state.timerCount += segment * m_timerspeed;
+	if (untilTimer == 0)
+	{
+		m_state.timerCount -= m_clockspeed;
+		TickTimers(m_state.cycleCount);
+		untilTimer = CyclesUntilTimer();
 	}
+	goto next_segment;
+#else
+	RunSwitch(count);
+#endif
 }
 
 void c8e_CPU::ClearScreen()
 {
-	for (int i = 0; i < (WIDTH_PIXELS * HEIGHT_PIXELS); i++)
+	for (int y = 0; y < HEIGHT_PIXELS; y++)
 	{
-		m_renderData[i] = 0;
+		m_dirtyRows |= (u32)(m_state.renderRows[y] != 0) << y;
 	}
+	memset(m_state.renderRows, 0, HEIGHT_PIXELS * sizeof(u64));
+}
+
+void c8e_CPU::DrawSprite(u8 vx, u8 vy, int height)
+{
+	int _x = vx % WIDTH_PIXELS;
+	int _y = vy % HEIGHT_PIXELS;
+	int address = m_state.I;
+
+	// line each sprite row up with its screen column, pixels past the right edge fall off the end
+	u64 shifted[SPRITE_MAX_HEIGHT];
+	const u64* masks = shifted;
+	bool cacheable = (height > 0 && address + height <= RAM_SIZE);
+	c8e_SpriteMask* entry = &m_sprites[(address + _x * 37) & (SPRITE_CACHE_SIZE - 1)];
+	if (cacheable && entry->address == address && entry->x == _x && entry->height == height)
+	{
+		m_spriteHits++;
+		masks = entry->rows;
+	}
+	else
+	{
+		u64* rows = cacheable ? entry->rows : shifted;
+		for (int y = 0; y < height; y++)
+		{
+			rows[y] = (_x <= WIDTH_PIXELS - 8) ? ((u64)m_state.ram[(address + y) & RAM_MASK] << (WIDTH_PIXELS - 8 - _x)) : ((u64)m_state.ram[(address + y) & RAM_MASK] >> (_x - (WIDTH_PIXELS - 8)));
+		}
+		if (cacheable)
+		{
+			m_spriteMisses++;
+			entry->address = (u16)address;
+			entry->x = (u8)_x;
+			entry->height = (u8)height;
+			memset(m_spriteMap + address, 1, height);
+			masks = rows;
+		}
+	}
+
+	if (height > HEIGHT_PIXELS - _y)
+	{
+		height = HEIGHT_PIXELS - _y;
+	}
+	u64* row = m_state.renderRows + _y;
+	u64 collision = 0;
+	u32 changed = 0;
+	for (int y = 0; y < height; y++)
+	{
+		collision |= row[y] & masks[y];
+		row[y] ^= masks[y];
+		changed |= (u32)(masks[y] != 0) << y;
+	}
+	m_dirtyRows |= changed << _y;
+	_VF = (collision != 0);
+}
+
+void c8e_CPU::InvalidateSprites(int address, int end)
+{
+	// writes over sprite data are rare, drop the whole cache when one happens
+	for (int i = address; i < end; i++)
+	{
+		if (m_spriteMap[i])
+		{
+			memset(m_sprites, 0, SPRITE_CACHE_SIZE * sizeof(c8e_SpriteMask));
+			memset(m_spriteMap, 0, RAM_SIZE);
+			return;
+		}
+	}
+}
+
+bool c8e_CPU::EndsBlock(c8e_OpHandler handler)
+{
+	// anything that moves the program counter, or writes memory that may hold code
+	return handler == Op_Return || handler == Op_Jump || handler == Op_Call || handler == Op_JumpOffset
+		|| handler == Op_SkipEqualImm || handler == Op_SkipNotEqualImm || handler == Op_SkipEqual || handler == Op_SkipNotEqual
+		|| handler == Op_SkipKey || handler == Op_SkipNotKey || handler == Op_WaitKey
+		|| handler == Op_BCD || handler == Op_Store;
+}
+
+bool c8e_CPU::StartsBlock(c8e_OpHandler handler)
+{
+	// anything stamped with the cycle count, which is only brought up to date between blocks
+	return handler == Op_SetSound;
+}
+
+const c8e_Op& c8e_CPU::LookupOp(u16 opcode)
+{
+	return s_opTable.ops[opcode];
+}
+
+void c8e_CPU::Op_Nop(c8e_CPU*, const c8e_Op&)
+{
+}
+
+void c8e_CPU::Op_Trap(c8e_CPU* cpu, const c8e_Op&)
+{
+	// unhandled instruction! carry on as a no-op but let the caller know
+	cpu->m_events |= EVENT_TRAP;
+}
+
+void c8e_CPU::Op_ClearScreen(c8e_CPU* cpu, const c8e_Op&)
+{
+	cpu->ClearScreen();
+}
+
+void c8e_CPU::Op_Return(c8e_CPU* cpu, const c8e_Op&)
+{
+	cpu->m_state.pc = cpu->Pop();
+}
+
+void c8e_CPU::Op_Jump(c8e_CPU* cpu, const c8e_Op& op)
+{
+	cpu->m_state.pc = op.nnn;
+}
+
+void c8e_CPU::Op_Call(c8e_CPU* cpu, const c8e_Op& op)
+{
+	cpu->Push(cpu->m_state.pc);
+	cpu->m_state.pc = op.nnn;
+}
+
+void c8e_CPU::Op_SkipEqualImm(c8e_CPU* cpu, const c8e_Op& op)
+{
+	cpu->Skip(cpu->m_state.V[op.x] == op.nn);
+}
+
+void c8e_CPU::Op_SkipNotEqualImm(c8e_CPU* cpu, const c8e_Op& op)
+{
+	cpu->Skip(cpu->m_state.V[op.x] != op.nn);
+}
+
+void c8e_CPU::Op_SkipEqual(c8e_CPU* cpu, const c8e_Op& op)
+{
+	cpu->Skip(cpu->m_state.V[op.x] == cpu->m_state.V[op.y]);
+}
+
+void c8e_CPU::Op_SkipNotEqual(c8e_CPU* cpu, const c8e_Op& op)
+{
+	cpu->Skip(cpu->m_state.V[op.x] != cpu->m_state.V[op.y]);
+}
+
+void c8e_CPU::Op_SetImm(c8e_CPU* cpu, const c8e_Op& op)
+{
+	cpu->m_state.V[op.x] = op.nn;
+}
+
+void c8e_CPU::Op_AddImm(c8e_CPU* cpu, const c8e_Op& op)
+{
+	cpu->m_state.V[op.x] += op.nn;
+}
+
+void c8e_CPU::Op_Set(c8e_CPU* cpu, const c8e_Op& op)
+{
+	cpu->m_state.V[op.x] = cpu->m_state.V[op.y];
+}
+
+void c8e_CPU::Op_Or(c8e_CPU* cpu, const c8e_Op& op)
+{
+	cpu->m_state.V[op.x] = cpu->m_state.V[op.x] | cpu->m_state.V[op.y];
+}
+
+void c8e_CPU::Op_And(c8e_CPU* cpu, const c8e_Op& op)
+{
+	cpu->m_state.V[op.x] = cpu->m_state.V[op.x] & cpu->m_state.V[op.y];
+}
+
+void c8e_CPU::Op_Xor(c8e_CPU* cpu, const c8e_Op& op)
+{
+	cpu->m_state.V[op.x] = cpu->m_state.V[op.x] ^ cpu->m_state.V[op.y];
+}
+
+void c8e_CPU::Op_Add(c8e_CPU* cpu, const c8e_Op& op)
+{
+	u8* V = cpu->m_state.V;
+	u8 val = V[op.x] + V[op.y];
+	V[0x0f] = (val < V[op.x]) || (val < V[op.y]);
+	V[op.x] = val;
+}
+
+void c8e_CPU::Op_Sub(c8e_CPU* cpu, const c8e_Op& op)
+{
+	u8* V = cpu->m_state.V;
+	V[0x0f] = (V[op.x] >= V[op.y]);
+	V[op.x] = V[op.x] - V[op.y];
+}
+
+void c8e_CPU::Op_SubReverse(c8e_CPU* cpu, const c8e_Op& op)
+{
+	u8* V = cpu->m_state.V;
+	V[0x0f] = (V[op.y] >= V[op.x]);
+	V[op.x] = V[op.y] - V[op.x];
+}
+
+void c8e_CPU::Op_ShiftRight(c8e_CPU* cpu, const c8e_Op& op)
+{
+	u8* V = cpu->m_state.V;
+	V[0x0f] = V[op.x] & 0x01;
+	V[op.x] = V[op.x] >> 1;
+}
+
+void c8e_CPU::Op_ShiftLeft(c8e_CPU* cpu, const c8e_Op& op)
+{
+	u8* V = cpu->m_state.V;
+	V[0x0f] = (V[op.x] & 0x80) > 0;
+	V[op.x] = V[op.x] << 1;
+}
+
+void c8e_CPU::Op_SetIndex(c8e_CPU* cpu, const c8e_Op& op)
+{
+	cpu->m_state.I = op.nnn;
+}
+
+void c8e_CPU::Op_JumpOffset(c8e_CPU* cpu, const c8e_Op& op)
+{
+	cpu->m_state.pc = (op.nnn + cpu->m_state.V[0]) & RAM_MASK;
+}
+
+void c8e_CPU::Op_Random(c8e_CPU* cpu, const c8e_Op& op)
+{
+	cpu->m_state.V[op.x] = cpu->NextRandom() & op.nn;
+}
+
+void c8e_CPU::Op_Display(c8e_CPU* cpu, const c8e_Op& op)
+{
+	cpu->DrawSprite(cpu->m_state.V[op.x], cpu->m_state.V[op.y], op.n);
+}
+
+void c8e_CPU::Op_SkipKey(c8e_CPU* cpu, const c8e_Op& op)
+{
+	cpu->Skip(cpu->m_state.input[cpu->m_state.V[op.x] & 0x0f]);
+}
+
+void c8e_CPU::Op_SkipNotKey(c8e_CPU* cpu, const c8e_Op& op)
+{
+	cpu->Skip(!cpu->m_state.input[cpu->m_state.V[op.x] & 0x0f]);
+}
+
+void c8e_CPU::Op_ReadDelay(c8e_CPU* cpu, const c8e_Op& op)
+{
+	cpu->m_state.V[op.x] = cpu->m_state.delay;
+}
+
+void c8e_CPU::Op_SetDelay(c8e_CPU* cpu, const c8e_Op& op)
+{
+	cpu->m_state.delay = cpu->m_state.V[op.x];
+}
+
+void c8e_CPU::Op_SetSound(c8e_CPU* cpu, const c8e_Op& op)
+{
+	// run one at a time or first in a block, so the cycle count is up to date
+	cpu->SetSoundTimer(cpu->m_state.V[op.x], cpu->m_state.cycleCount);
+}
+
+void c8e_CPU::Op_WaitKey(c8e_CPU* cpu, const c8e_Op& op)
+{
+	for (u8 i = 0; i <= 0x0f; i++)
+	{
+		if (cpu->m_state.input[i])
+		{
+			cpu->m_state.V[op.x] = i;
+			return;
+		}
+	}
+	cpu->m_state.pc = (cpu->m_state.pc - 2) & RAM_MASK;
+	cpu->m_events |= EVENT_WAITKEY;
+}
+
+void c8e_CPU::Op_AddIndex(c8e_CPU* cpu, const c8e_Op& op)
+{
+	// I wraps inside ram instead of overflowing, so VF is always cleared
+	cpu->m_state.I = (cpu->m_state.I + cpu->m_state.V[op.x]) & RAM_MASK;
+	cpu->m_state.V[0x0f] = 0;
+}
+
+void c8e_CPU::Op_FontChar(c8e_CPU* cpu, const c8e_Op& op)
+{
+	u8 ch = ((cpu->m_state.V[op.x] & 0x0F) * FONT_HEIGHT);
+	cpu->m_state.I = FONT_OFFSET + ch;
+}
+
+void c8e_CPU::Op_BCD(c8e_CPU* cpu, const c8e_Op& op)
+{
+	u8 dec = cpu->m_state.V[op.x];
+	u8* ram = cpu->m_state.ram;
+	u16 I = cpu->m_state.I;
+	ram[I] = dec / 100;
+	ram[(I + 1) & RAM_MASK] = (dec % 100) / 10;
+	ram[(I + 2) & RAM_MASK] = (dec % 10);
+	cpu->InvalidateCode(I, 3);
+}
+
+void c8e_CPU::Op_Store(c8e_CPU* cpu, const c8e_Op& op)
+{
+	for (int i = 0; i <= op.x; i++)
+	{
+		cpu->m_state.ram[(cpu->m_state.I + i) & RAM_MASK] = cpu->m_state.V[i];
+	}
+	cpu->InvalidateCode(cpu->m_state.I, op.x + 1);
+}
+
+void c8e_CPU::Op_Load(c8e_CPU* cpu, const c8e_Op& op)
+{
+	for (int i = 0; i <= op.x; i++)
+	{
+		cpu->m_state.V[i] = cpu->m_state.ram[(cpu->m_state.I + i) & RAM_MASK];
+	}
+}
+
+void c8e_CPU::Op_SetImmPair(c8e_CPU* cpu, const c8e_Op& op)
+{
+	// 6xnn 6ynn, the second register in y and its value in nnn
+	cpu->m_state.V[op.x] = op.nn;
+	cpu->m_state.V[op.y] = (u8)op.nnn;
+}
+
+void c8e_CPU::Op_ShiftLeftN(c8e_CPU* cpu, const c8e_Op& op)
+{
+	// n repeats of 8xyE, VF keeps the last bit shifted out
+	u8* V = cpu->m_state.V;
+	V[0x0f] = (V[op.x] >> (8 - op.n)) & 0x01;
+	V[op.x] = V[op.x] << op.n;
+}
+
+void c8e_CPU::Op_SetIndexAdd(c8e_CPU* cpu, const c8e_Op& op)
+{
+	// Annn Fx1E
+	cpu->m_state.I = (op.nnn + cpu->m_state.V[op.x]) & RAM_MASK;
+	cpu->m_state.V[0x0f] = 0;
+}
+
+void c8e_CPU::Op_SetIndexLoad(c8e_CPU* cpu, const c8e_Op& op)
+{
+	// Annn Fx65
+	cpu->m_state.I = op.nnn;
+	Op_Load(cpu, op);
+}
+
+void c8e_CPU::Op_AddImmSkip(c8e_CPU* cpu, const c8e_Op& op)
+{
+	// 7xnn then 3xkk or 4xkk, kk in nnn
+	cpu->m_state.V[op.x] += op.nn;
+	cpu->Skip((cpu->m_state.V[op.x] == op.nnn) == (op.n != 0));
+}
+
+void c8e_CPU::Op_ReadDelaySkip(c8e_CPU* cpu, const c8e_Op& op)
+{
+	// Fx07 then 3xkk or 4xkk, kk in nnn
+	cpu->m_state.V[op.x] = cpu->m_state.delay;
+	cpu->Skip((cpu->m_state.V[op.x] == op.nnn) == (op.n != 0));
 }
\ No newline at end of file
@@ -1,55 +1,295 @@
 #pragma once
 
-#include <chrono>
+#include <stddef.h>
+#include <type_traits>
 
-typedef unsigned char u8;
-typedef unsigned short u16;
+#include "c8e_constants.h"
 
 #define DEFAULT_CLOCKSPEED (700)
+#define DEFAULT_SEED (0x2545f491) // Cxnn sequence of a cpu nobody seeded
 #define TIMERSPEED (60)
 
+// Event flags returned by the stepping functions
+#define EVENT_NONE (0)
+#define EVENT_FRAME (1 << 0) // timers ticked, a new frame is ready to present
+#define EVENT_SOUND (1 << 1) // sound timer switched on or off
+#define EVENT_WAITKEY (1 << 2) // blocked in Fx0A waiting for a key press
+#define EVENT_TRAP (1 << 3) // executed an invalid opcode
+#define EVENT_HALT (1 << 4) // reached a jump to itself, only the timers will ever change again
+#define EVENT_IDLE (1 << 5) // part of the step was skipped in an idle loop
+
+// Interpreter engines
+#define ENGINE_SWITCH (0) // fetch and decode every instruction
+#define ENGINE_BLOCK (1) // run pre-decoded basic blocks from a cache
+#define ENGINE_THREADED (2) // direct threaded code, falls back to ENGINE_SWITCH on compilers without labels as values
+#define ENGINE_TABLE (3) // one lookup per instruction in a table of all 65536 decoded opcodes
+#define ENGINE_JIT (4) // hot blocks recompiled to native x86-64 code, ENGINE_BLOCK where that isn't supported
+#define ENGINE_STATIC (5) // rom translated ahead of time by c8e_Recompiler, ENGINE_BLOCK for roms not linked in
+
+#define BLOCK_MAX_OPS (32)
+
+#define SPRITE_CACHE_SIZE (256) // direct mapped, must be a power of two
+#define SPRITE_MAX_HEIGHT (15)
+
+#define KEY_EVENT_QUEUE (64) // pending key changes, must be a power of two
+
+#define STATE_MAGIC (0x53453843) // "C8ES", leads every serialized state
+#define STATE_VERSION (2) // bump whenever c8e_State changes layout
+
+struct c8e_CPU;
+struct c8e_Op;
+
+typedef void (*c8e_OpHandler)(c8e_CPU* cpu, const c8e_Op& op);
+
+// A decoded instruction, with its operands already extracted
+struct c8e_Op
+{
+	c8e_OpHandler handler;
+	u16 nnn; // address operand, also the branch target of jumps and calls
+	u8 x;
+	u8 y;
+	u8 n;
+	u8 nn;
+	u8 length; // instructions covered, more than one for fused sequences
+};
+
+// A straight run of instructions ending in a branch, skip or memory store
+struct c8e_Block
+{
+	bool valid;
+	u16 start; // address of the first instruction
+	u16 next; // fall-through address after the last instruction
+	int length; // instructions
+	int count; // ops, fewer than length where sequences were fused
+	c8e_Op ops[BLOCK_MAX_OPS];
+};
+
+// A key change, applied just before the instruction at cycle runs
+struct c8e_KeyEvent
+{
+	u64 cycle;
+	u8 key;
+	bool down;
+};
+
+// The whole machine, trivially copyable so it can be cloned, compared or snapshotted with memcpy
+struct alignas(64) c8e_State
+{
+	u8 ram[RAM_SIZE];
+	u64 renderRows[HEIGHT_PIXELS]; // framebuffer, one word per row with the leftmost pixel in the top bit
+
+	// registers, sharing one cache line
+	u8 V[NUM_REGISTERS];
+	u16 stack[STACK_SIZE]; // return addresses
+	u16 pc; // address of the next instruction
+	u16 I; // index register
+	u8 sp; // next free stack slot
+	u8 delay;
+	u8 sound;
+	u8 padding;
+	u64 cycleCount; // instructions executed since power on
+
+	int timerCount; // fixed point fraction of a timer tick, in units of 1/clockspeed
+	bool input[NUM_KEYS]; // keyboard state
+	u32 random; // xorshift generator behind Cxnn, never zero
+};
+
+static_assert(std::is_trivially_copyable<c8e_State>::value, "c8e_State must stay copyable with memcpy");
+
+// Leads a serialized c8e_State, the state follows as raw bytes in host byte order
+struct c8e_StateHeader
+{
+	u32 magic;
+	u16 version;
+	u16 headerSize;
+	u32 stateSize;
+	int clockspeed;
+};
+
+#define STATE_BLOB_SIZE (sizeof(c8e_StateHeader) + sizeof(c8e_State))
+#define STATE_HASHED_SIZE (offsetof(c8e_State, random) + sizeof(u32)) // leaves out the tail padding from alignas(64), copies needn't keep it
+
+// Sprite rows already shifted to a screen column, ready to XOR into the framebuffer
+struct c8e_SpriteMask
+{
+	u16 address; // sprite address in ram
+	u8 height; // 0 for an empty entry
+	u8 x; // screen column
+	u64 rows[SPRITE_MAX_HEIGHT];
+};
+
+struct c8e_JIT;
+struct c8e_Audio;
+struct c8e_Movie;
+struct c8e_AOTProgram;
+
 struct c8e_CPU
 {
+	friend struct c8e_OpTable;
+	friend struct c8e_JIT;
+	friend struct c8e_AOT;
+	friend struct c8e_Recompiler;
+
 public:
-	c8e_CPU();
+	c8e_CPU(const char* romName, int engine = ENGINE_BLOCK);
 	~c8e_CPU();
 
-	void UpdateInput(bool* keys) { m_input = keys; }
+	void QueueKey(c8e_KeyEvent event);
+	void ClearKeys() { m_keyTail = m_keyHead; } // drops key changes queued but not yet applied
+	void SetKeys(u16 keys); // applied immediately, bit n for key n
+	void SetAudio(c8e_Audio* audio) { m_audio = audio; }
+	c8e_Audio* GetAudio() { return m_audio; }
+	void SetMovie(c8e_Movie* movie) { m_movie = movie; } // records every key change at the cycle it was applied
+	void SetSeed(u32 seed) { m_state.random = seed ? seed : DEFAULT_SEED; }
 	int GetClockSpeed() { return m_clockspeed; }
-	bool* GetRenderData() {	return m_renderData; }
-	bool GetSoundActive() { return m_soundCount > 0; }
+	u32 GetRomChecksum() { return m_romChecksum; } // FNV-1a of the rom image as loaded
+	const u64* GetRenderRows() { return m_state.renderRows; }
+	u32 TakeDirtyRows() { u32 rows = m_dirtyRows; m_dirtyRows = 0; return rows; } // rows changed since the last call, bit n for row n
+	bool GetSoundActive() { return m_state.sound > 0; }
+	u64 GetCycleCount() { return m_state.cycleCount; }
+	u64 GetSpriteHits() { return m_spriteHits; }
+	u64 GetSpriteMisses() { return m_spriteMisses; }
+	u64 GetKeyEvents() { return m_keyEvents; }
+	u64 GetKeyLateCycles() { return m_keyLateCycles; } // total cycles key events were applied after their timestamp
+	u64 GetIdleCycles() { return m_idleCycles; } // cycles skipped in idle loops rather than run
+
+	// Cloning and snapshots, caches are kept wherever the new ram matches the old
+	const c8e_State& GetState() { return m_state; }
+	void SetState(const c8e_State& state);
 
-	bool AdvanceTime();
+	// Speculative runs, whatever runs between the two is undone with no sound or recorded keys
+	void BeginSpeculation();
+	void EndSpeculation();
+
+	// Save states, a versioned blob of STATE_BLOB_SIZE bytes
+	size_t SaveState(u8* buffer, size_t size); // bytes written, 0 if the buffer is too small
+	bool LoadState(const u8* buffer, size_t size); // false and unchanged if the blob doesn't match this build
+
+	// Deterministic stepping, emulated time is counted in cycles only
+	int StepInstructions(int count);
+	int RunFrame(int ipf);
+	int StepFrame() { return StepInstructions(CyclesUntilTimer()); } // up to and including the next timer tick at the current clock
 
 private:
 	void InitFont();
-	void LoadRom();
+	void LoadRom(const char* romName);
 
 	void ClearScreen();
+	void DrawSprite(u8 vx, u8 vy, int height);
+	void InvalidateSprites(int address, int end);
+	void TickTimers(u64 cycle); // cycle the tick falls on, stamps the sound off edge
+	void SetSoundTimer(u8 value, u64 cycle); // cycle the instruction runs on, stamps the edge for the audio
+	void AddCycles(int cycles);
+	void ApplyKeys();
+	void ApplyKey(const c8e_KeyEvent& event);
+	u8 NextRandom() { u32 x = m_state.random; x ^= x << 13; x ^= x >> 17; x ^= x << 5; m_state.random = x; return (u8)(x >> 24); }
+	void RunEngine(int count);
+	int IdleCycles(int count, int& lead);
+	int CyclesUntilTimer();
 
 	u16 Fetch();
+	void Skip(bool condition) { m_state.pc = (m_state.pc + 2 * condition) & RAM_MASK; }
+	void Push(u16 address) { m_state.stack[m_state.sp] = address; m_state.sp = (m_state.sp + 1) & (STACK_SIZE - 1); }
+	u16 Pop() { m_state.sp = (m_state.sp - 1) & (STACK_SIZE - 1); return m_state.stack[m_state.sp]; }
 	void Decode(u16 opcode);
+	void DecodeSwitch(u16 opcode);
 
-	std::chrono::time_point<std::chrono::system_clock> m_prevDelta = std::chrono::system_clock::now();
-	int m_clockspeed = DEFAULT_CLOCKSPEED; // store in member variable so could be made variable, guide suggested 700
-	double m_clockCount = 0;
+	void RunSwitch(int count);
+	void RunBlocks(int count);
+	void RunThreaded(int count);
+	void RunTable(int count);
+	void RunStatic(int count);
+	c8e_Block* BuildBlock(u16 address);
+	static void FuseOps(c8e_Block* block);
+	void InvalidateCode(int address, int length);
+
+	static bool EndsBlock(c8e_OpHandler handler);
+	static bool StartsBlock(c8e_OpHandler handler);
+	static const c8e_Op& LookupOp(u16 opcode);
+
+	// instruction handlers for pre-decoded ops
+	static void Op_Nop(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_Trap(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_ClearScreen(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_Return(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_Jump(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_Call(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_SkipEqualImm(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_SkipNotEqualImm(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_SkipEqual(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_SkipNotEqual(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_SetImm(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_AddImm(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_Set(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_Or(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_And(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_Xor(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_Add(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_Sub(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_SubReverse(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_ShiftRight(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_ShiftLeft(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_SetIndex(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_JumpOffset(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_Random(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_Display(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_SkipKey(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_SkipNotKey(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_ReadDelay(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_SetDelay(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_SetSound(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_WaitKey(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_AddIndex(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_FontChar(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_BCD(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_Store(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_Load(c8e_CPU* cpu, const c8e_Op& op);
 
+	// fused handlers for the sequences FuseOps recognises
+	static void Op_SetImmPair(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_ShiftLeftN(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_SetIndexAdd(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_SetIndexLoad(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_AddImmSkip(c8e_CPU* cpu, const c8e_Op& op);
+	static void Op_ReadDelaySkip(c8e_CPU* cpu, const c8e_Op& op);
+
+	c8e_State m_state = {};
+	c8e_State m_speculationState; // state at BeginSpeculation
+
+	int m_engine;
+
+	int m_clockspeed = DEFAULT_CLOCKSPEED; // store in member variable so could be made variable, guide suggested 700
 	int m_timerspeed = TIMERSPEED;
-	double m_timerCount = 0;
-	u8 m_delayCount = 0;
-	u8 m_soundCount = 0;
+	int m_events = EVENT_NONE; // events raised by the current step
 
-	u8* m_ram; // memory
-	u16* m_pc; // program counter
+	c8e_KeyEvent m_keyQueue[KEY_EVENT_QUEUE]; // pending key changes in cycle order
+	u32 m_keyHead = 0; // next free slot
+	u32 m_keyTail = 0; // oldest pending event
+	u64 m_keyEvents = 0;
+	u64 m_keyLateCycles = 0;
+	u64 m_idleCycles = 0;
 
-	u16** m_stack; // stack of addresses
-	int m_stackIdx;
+	u32 m_dirtyRows = 0; // bit n set when row n changed since TakeDirtyRows
 
-	u8* m_I; // index register
+	// put back by EndSpeculation
+	u32 m_speculationKeyTail = 0;
+	u32 m_speculationDirtyRows = 0;
+	c8e_Audio* m_speculationAudio = NULL;
+	c8e_Movie* m_speculationMovie = NULL;
 
-	u8* m_V; // variable registers
+	c8e_SpriteMask* m_sprites; // indexed by a hash of address and column
+	u8* m_spriteMap; // non-zero for every byte of ram read into m_sprites
+	u64 m_spriteHits = 0;
+	u64 m_spriteMisses = 0;
 
-	bool* m_input; // keyboard state
+	c8e_Block** m_blocks; // decoded blocks indexed by start address, built on first use
+	u8* m_codeMap; // non-zero for every byte of ram covered by a decoded block
+	u64 m_codeWrites = 0; // stores that hit a byte marked in m_codeMap
 
-	bool* m_renderData; // array of booleans to render (true) or not (false)
+	c8e_JIT* m_jit = NULL; // native code cache, only created for ENGINE_JIT
+	c8e_Audio* m_audio = NULL; // receives sound timer edges, owned by the frontend
+	c8e_Movie* m_movie = NULL; // receives applied key changes while recording, owned by the frontend
+	const c8e_AOTProgram* m_aot = NULL; // translation of the loaded rom, only used by ENGINE_STATIC
+	int m_romSize = 0;
+	u32 m_romChecksum = 0;
 };
\ No newline at end of file
@@ -0,0 +1,191 @@
+#include <string.h>
+
+#include "c8e_Audio.h"
+#include "c8e_EmuThread.h"
+
+#define EMU_SPIN_MARGIN_US (1000) // always spin for the final stretch before a deadline
+
+c8e_EmuThread::c8e_EmuThread(c8e_CPU* cpu, bool spin)
+{
+	m_cpu = cpu;
+	m_spin = spin;
+}
+
+c8e_EmuThread::~c8e_EmuThread()
+{
+	Stop();
+}
+
+void c8e_EmuThread::Start()
+{
+	m_running.store(true, std::memory_order_release);
+	m_thread = std::thread(&c8e_EmuThread::Run, this);
+}
+
+void c8e_EmuThread::Stop()
+{
+	m_running.store(false, std::memory_order_release);
+	if (m_thread.joinable())
+	{
+		m_thread.join();
+	}
+}
+
+void c8e_EmuThread::Run()
+{
+	c8e_Scheduler scheduler;
+	if (m_movie && m_replay)
+	{
+		scheduler.SetReplay(m_movie);
+	}
+
+	std::chrono::nanoseconds frameTime(1000000000 / TIMERSPEED);
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now();
+	while (m_running.load(std::memory_order_acquire))
+	{
+		c8e_InputEvent input;
+		while (m_keyQueue.Pop(input))
+		{
+			// a replay only takes the movie's key changes
+			if (!m_replay)
+			{
+				m_cpu->QueueKey(scheduler.Stamp(m_cpu, input));
+			}
+		}
+
+		HandleStates();
+
+		if (m_audioSync)
+		{
+			scheduler.SetRateAdjust(m_audioSync->GetRateAdjust());
+		}
+
+		u64 cycles = m_cpu->GetCycleCount();
+		u64 idleCycles = m_cpu->GetIdleCycles();
+
+		if (m_rewind && m_rewinding.load(std::memory_order_relaxed))
+		{
+			// one captured frame back per frame, time spent rewinding isn't owed afterwards
+			c8e_State state;
+			if (m_rewind->Step(state))
+			{
+				m_cpu->SetState(state);
+				PublishFrame(m_cpu->GetRenderRows(), m_cpu->TakeDirtyRows());
+				if (m_runAhead)
+				{
+					m_runAhead->Invalidate();
+				}
+			}
+			scheduler.Hold();
+		}
+		else
+		{
+			// run everything owed, publishing each completed frame
+			do
+			{
+				if (scheduler.Advance(m_cpu) & EVENT_FRAME)
+				{
+					if (m_rewind)
+					{
+						m_rewind->Capture(m_cpu->GetState());
+					}
+					if (m_movie && !m_replay)
+					{
+						m_movie->Frame(m_cpu);
+					}
+					if (m_runAhead && m_runAhead->GetFrames())
+					{
+						u32 dirtyRows = m_runAhead->Run(m_cpu);
+						PublishFrame(m_runAhead->GetRenderRows(), dirtyRows);
+					}
+					else
+					{
+						PublishFrame(m_cpu->GetRenderRows(), m_cpu->TakeDirtyRows());
+					}
+				}
+			} while (scheduler.GetOwedCycles() > 0);
+		}
+
+		// nothing but idle loops ran, so there's nothing to react to sooner and even spin pacing sleeps
+		bool idle = m_cpu->GetCycleCount() > cycles && m_cpu->GetCycleCount() - cycles == m_cpu->GetIdleCycles() - idleCycles;
+
+		deadline += frameTime;
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (now > deadline + frameTime)
+		{
+			deadline = now; // fell behind, don't try to catch up on sleeps
+		}
+		WaitUntil(deadline, m_spin && !idle);
+	}
+
+	m_drift = scheduler.GetDrift();
+	m_droppedCycles = scheduler.GetDroppedCycles();
+}
+
+bool c8e_EmuThread::PushState(const u8* blob, size_t size)
+{
+	if (m_loadPending.load(std::memory_order_acquire) || size > sizeof(m_loadBlob))
+	{
+		return false;
+	}
+	memcpy(m_loadBlob, blob, size);
+	m_loadSize = size;
+	m_loadPending.store(true, std::memory_order_release);
+	return true;
+}
+
+void c8e_EmuThread::HandleStates()
+{
+	// between frames, so a save never catches a half drawn screen
+	if (m_saveRequested.exchange(false, std::memory_order_acquire) && m_saveWriter)
+	{
+		u8 blob[STATE_BLOB_SIZE];
+		size_t size = m_cpu->SaveState(blob, sizeof(blob));
+		m_saveWriter->Write(m_savePath, blob, size);
+	}
+	if (m_loadPending.load(std::memory_order_acquire))
+	{
+		m_cpu->LoadState(m_loadBlob, m_loadSize);
+		m_loadPending.store(false, std::memory_order_release);
+	}
+}
+
+void c8e_EmuThread::PublishFrame(const u64* rows, u32 dirtyRows)
+{
+	c8e_Frame* frame = m_frames.GetBack();
+	memcpy(frame->rows, rows, sizeof(frame->rows));
+	frame->dirtyRows = dirtyRows | m_lostDirtyRows;
+
+	// a frame the reader skipped still has to reach it as dirty rows
+	const c8e_Frame* lost = m_frames.Publish();
+	m_lostDirtyRows = lost ? lost->dirtyRows : 0;
+	m_droppedFrames += (lost != NULL);
+}
+
+void c8e_EmuThread::WaitUntil(std::chrono::steady_clock::time_point deadline, bool spin)
+{
+	// sleep for most of the wait, then spin to hit the deadline
+	std::chrono::nanoseconds spinMargin = std::chrono::microseconds(EMU_SPIN_MARGIN_US);
+	for (;;)
+	{
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (now >= deadline || !m_running.load(std::memory_order_relaxed))
+		{
+			break;
+		}
+
+		std::chrono::nanoseconds remaining = deadline - now;
+		if (spin || remaining <= spinMargin + m_sleepSlack)
+		{
+			continue;
+		}
+
+		std::chrono::nanoseconds requested = remaining - spinMargin - m_sleepSlack;
+		std::this_thread::sleep_for(requested);
+
+		// calibrate against how late the sleep actually returned
+		std::chrono::nanoseconds slept = std::chrono::steady_clock::now() - now;
+		std::chrono::nanoseconds oversleep = (slept > requested) ? (slept - requested) : std::chrono::nanoseconds(0);
+		m_sleepSlack = (m_sleepSlack * 7 + oversleep) / 8;
+	}
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "c8e_CPU.h"
+#include "c8e_Movie.h"
+#include "c8e_Rewind.h"
+#include "c8e_RunAhead.h"
+#include "c8e_SaveFile.h"
+#include "c8e_Scheduler.h"
+
+#define KEY_QUEUE_SIZE (64) // must be a power of two
+#define TRIPLE_FRESH (4) // set in c8e_TripleBuffer::m_middle when it holds a frame the reader hasn't taken
+
+// A completed frame handed from the emulation thread to the presenting thread
+struct c8e_Frame
+{
+	u64 rows[HEIGHT_PIXELS];
+	u32 dirtyRows; // rows changed since the last frame the reader took
+};
+
+// Lock-free triple buffer, the writer never waits and the reader always gets the newest frame
+struct c8e_TripleBuffer
+{
+public:
+	c8e_Frame* GetBack() { return &m_frames[m_back]; }
+
+	// writer only, returns the frame swapped out if the reader never took it, otherwise NULL
+	const c8e_Frame* Publish()
+	{
+		int prev = m_middle.exchange(m_back | TRIPLE_FRESH, std::memory_order_acq_rel);
+		m_back = prev & ~TRIPLE_FRESH;
+		return (prev & TRIPLE_FRESH) ? &m_frames[m_back] : NULL;
+	}
+
+	// reader only, NULL when nothing new was published
+	const c8e_Frame* Acquire()
+	{
+		if (!(m_middle.load(std::memory_order_relaxed) & TRIPLE_FRESH))
+		{
+			return NULL;
+		}
+		m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & ~TRIPLE_FRESH;
+		return &m_frames[m_front];
+	}
+
+private:
+	c8e_Frame m_frames[3] = {};
+	int m_back = 0; // owned by the writer
+	int m_front = 1; // owned by the reader
+	std::atomic<int> m_middle{ 2 }; // handed between them
+};
+
+// Single producer, single consumer ring of key changes
+struct c8e_KeyQueue
+{
+public:
+	bool Push(const c8e_InputEvent& event)
+	{
+		u32 head = m_head.load(std::memory_order_relaxed);
+		if (head - m_tail.load(std::memory_order_acquire) == KEY_QUEUE_SIZE)
+		{
+			return false;
+		}
+		m_events[head & (KEY_QUEUE_SIZE - 1)] = event;
+		m_head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool Pop(c8e_InputEvent& event)
+	{
+		u32 tail = m_tail.load(std::memory_order_relaxed);
+		if (tail == m_head.load(std::memory_order_acquire))
+		{
+			return false;
+		}
+		event = m_events[tail & (KEY_QUEUE_SIZE - 1)];
+		m_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	c8e_InputEvent m_events[KEY_QUEUE_SIZE];
+	std::atomic<u32> m_head{ 0 }; // written by the producer
+	std::atomic<u32> m_tail{ 0 }; // written by the consumer
+};
+
+// Runs c8e_CPU in realtime on its own thread, so presenting can block without stalling emulation
+struct c8e_EmuThread
+{
+public:
+	c8e_EmuThread(c8e_CPU* cpu, bool spin);
+	~c8e_EmuThread();
+
+	void SetAudioSync(c8e_Audio* audio) { m_audioSync = audio; } // before Start, lets the audio fill level steer the clock
+	void SetSaveFile(c8e_SaveWriter* writer, const char* path) { m_saveWriter = writer; m_savePath = path; } // before Start
+	void SetRewind(c8e_Rewind* rewind) { m_rewind = rewind; } // before Start, captured every frame
+	void SetRunAhead(c8e_RunAhead* runAhead) { m_runAhead = runAhead; } // before Start, frames are published from it when it runs ahead
+	void SetMovie(c8e_Movie* movie, bool replay) { m_movie = movie; m_replay = replay; } // before Start, recording unless replay
+	void Start();
+	void Stop();
+
+	// called from the presenting thread
+	bool PushKey(const c8e_InputEvent& event) { return m_keyQueue.Push(event); }
+	const c8e_Frame* AcquireFrame() { return m_frames.Acquire(); }
+	void RequestSave() { m_saveRequested.store(true, std::memory_order_release); } // serialized between frames, written in the background
+	bool PushState(const u8* blob, size_t size); // false while the previous state is still waiting to load
+	void SetRewinding(bool rewinding) { m_rewinding.store(rewinding, std::memory_order_relaxed); } // plays history backwards while set
+
+	// valid after Stop
+	long long GetDrift() { return m_drift; }
+	u64 GetDroppedCycles() { return m_droppedCycles; }
+	u64 GetDroppedFrames() { return m_droppedFrames; }
+
+private:
+	void Run();
+	void PublishFrame(const u64* rows, u32 dirtyRows);
+	void HandleStates();
+	void WaitUntil(std::chrono::steady_clock::time_point deadline, bool spin);
+
+	c8e_CPU* m_cpu; // only touched by the emulation thread while it runs
+	bool m_spin; // poll instead of sleeping between frames
+	c8e_Audio* m_audioSync = NULL;
+
+	std::thread m_thread;
+	std::atomic<bool> m_running{ false };
+
+	c8e_TripleBuffer m_frames;
+	c8e_KeyQueue m_keyQueue;
+
+	c8e_SaveWriter* m_saveWriter = NULL;
+	const char* m_savePath = NULL;
+	std::atomic<bool> m_saveRequested{ false };
+	u8 m_loadBlob[STATE_BLOB_SIZE]; // owned by the presenting thread until m_loadPending is set
+	size_t m_loadSize = 0;
+	std::atomic<bool> m_loadPending{ false };
+
+	c8e_Rewind* m_rewind = NULL; // only touched by the emulation thread while it runs
+	c8e_Movie* m_movie = NULL; // likewise
+	c8e_RunAhead* m_runAhead = NULL; // likewise
+	bool m_replay = false;
+	std::atomic<bool> m_rewinding{ false };
+	u32 m_lostDirtyRows = 0; // dirty rows of frames replaced before the reader took them
+
+	std::chrono::nanoseconds m_sleepSlack{ 0 }; // measured oversleep of sleep_for
+
+	long long m_drift = 0;
+	u64 m_droppedCycles = 0;
+	u64 m_droppedFrames = 0;
+};
@@ -0,0 +1,581 @@
+#include "c8e_JIT.h"
+
+#if defined(JIT_SUPPORTED)
+
+#include <string.h>
+#include <sys/mman.h>
+
+#define JIT_MAX_BLOCK_BYTES (4096) // worst case size of one compiled block
+
+// host registers, numbered as in the x86-64 ModRM encoding
+#define RAX (0)
+#define RCX (1)
+#define RDX (2)
+#define RSI (6)
+#define RDI (7)
+
+// condition codes for jcc/setcc
+#define CC_B (0x02)
+#define CC_AE (0x03)
+#define CC_E (0x04)
+#define CC_NE (0x05)
+#define CC_L (0x0c)
+
+// rbx holds the V register file and r15d the remaining cycle budget, these hold V registers inside a block
+static const int s_pool[JIT_HOST_REGISTERS] = { 5, 6, 7, 8, 9, 10, 11, 12, 13, 14 };
+
+c8e_JIT::c8e_JIT(c8e_CPU* cpu)
+{
+	m_cpu = cpu;
+	m_code = (u8*)mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m_code == MAP_FAILED)
+	{
+		m_code = NULL;
+		return;
+	}
+	Reset();
+}
+
+c8e_JIT::~c8e_JIT()
+{
+	if (m_code)
+	{
+		munmap(m_code, JIT_CODE_SIZE);
+	}
+}
+
+void c8e_JIT::Reset()
+{
+	m_emit = m_code;
+	EmitStubs();
+	for (int i = 0; i < RAM_SIZE; i++)
+	{
+		m_entries[i] = m_exitWithPC;
+		m_blockEnd[i] = 0;
+		m_hits[i] = 0;
+	}
+}
+
+void c8e_JIT::EmitStubs()
+{
+	// int enter(u8* V, void* entry, int budget)
+	m_enter = (c8e_JitEnter)m_emit;
+	Emit8(0x53); // push rbx
+	Emit8(0x55); // push rbp
+	Emit8(0x41); Emit8(0x54); // push r12
+	Emit8(0x41); Emit8(0x55); // push r13
+	Emit8(0x41); Emit8(0x56); // push r14
+	Emit8(0x41); Emit8(0x57); // push r15
+	Emit8(0x48); Emit8(0x83); Emit8(0xec); Emit8(0x08); // sub rsp, 8 (keep calls 16 byte aligned)
+	Emit8(0x48); Emit8(0x89); Emit8(0xfb); // mov rbx, rdi
+	Emit8(0x41); Emit8(0x89); Emit8(0xd7); // mov r15d, edx
+	Emit8(0xff); Emit8(0xe6); // jmp rsi
+
+	m_exitKeepPC = m_emit;
+	Emit8(0x44); Emit8(0x89); Emit8(0xf8); // mov eax, r15d
+	Emit8(0x48); Emit8(0x83); Emit8(0xc4); Emit8(0x08); // add rsp, 8
+	Emit8(0x41); Emit8(0x5f); // pop r15
+	Emit8(0x41); Emit8(0x5e); // pop r14
+	Emit8(0x41); Emit8(0x5d); // pop r13
+	Emit8(0x41); Emit8(0x5c); // pop r12
+	Emit8(0x5d); // pop rbp
+	Emit8(0x5b); // pop rbx
+	Emit8(0xc3); // ret
+
+	m_exitWithPC = m_emit;
+	Emit8(0x25); Emit32(RAM_MASK); // and eax, RAM_MASK
+	EmitMovAbs(RCX, (u64)&m_cpu->m_state.pc);
+	Emit8(0x66); Emit8(0x89); Emit8(0x01); // mov [rcx], ax
+	EmitJmp(m_exitKeepPC);
+}
+
+void c8e_JIT::Run(int count)
+{
+	c8e_CPU* cpu = m_cpu;
+	int untilTimer = cpu->CyclesUntilTimer();
+	while (count > 0)
+	{
+		int budget = (count < untilTimer) ? count : untilTimer;
+		int executed = 0;
+
+		int address = cpu->m_state.pc;
+		if (address <= RAM_SIZE - 2)
+		{
+			void* entry = m_entries[address];
+			if (entry == m_exitWithPC && ++m_hits[address] >= JIT_HOT_THRESHOLD)
+			{
+				entry = Compile((u16)address);
+			}
+			if (entry != m_exitWithPC)
+			{
+				executed = budget - m_enter(cpu->m_state.V, entry, budget);
+				if (executed == 0)
+				{
+					// the block is longer than the budget left, interpret up to the timer tick
+					for (; executed < budget; executed++)
+					{
+						cpu->Decode(cpu->Fetch());
+					}
+				}
+			}
+		}
+
+		if (executed == 0)
+		{
+			// cold code, count the visit and interpret one instruction
+			cpu->Decode(cpu->Fetch());
+			executed = 1;
+		}
+
+		count -= executed;
+		untilTimer -= executed;
+		cpu->m_state.cycleCount += executed;
+		cpu->m_state.timerCount += executed * cpu->m_timerspeed;
+		if (untilTimer == 0)
+		{
+			cpu->m_state.timerCount -= cpu->m_clockspeed;
+			cpu->TickTimers(cpu->m_state.cycleCount);
+			untilTimer = cpu->CyclesUntilTimer();
+		}
+	}
+}
+
+void c8e_JIT::Invalidate(int address, int end)
+{
+	int first = address - (BLOCK_MAX_OPS * 2 - 1);
+	if (first < 0)
+	{
+		first = 0;
+	}
+	for (int i = first; i < end; i++)
+	{
+		if (m_blockEnd[i] > address)
+		{
+			m_entries[i] = m_exitWithPC;
+			m_blockEnd[i] = 0;
+			m_hits[i] = 0;
+		}
+	}
+}
+
+void* c8e_JIT::Compile(u16 address)
+{
+	// blocks chain without returning here, so nothing that needs the cycle count is compiled
+	if (c8e_CPU::StartsBlock(c8e_CPU::LookupOp(*(u16*)(m_cpu->m_state.ram + address)).handler))
+	{
+		return m_exitWithPC;
+	}
+
+	if (m_emit + JIT_MAX_BLOCK_BYTES > m_code + JIT_CODE_SIZE)
+	{
+		Reset();
+	}
+
+	// find the extent of the block first, the entry check needs its length
+	const c8e_Op* ops[BLOCK_MAX_OPS];
+	int length = 0;
+	u16 pc = address;
+	while (length < BLOCK_MAX_OPS && pc <= RAM_SIZE - 2)
+	{
+		const c8e_Op& op = c8e_CPU::LookupOp(*(u16*)(m_cpu->m_state.ram + pc));
+		if (c8e_CPU::StartsBlock(op.handler))
+		{
+			break;
+		}
+		ops[length++] = &op;
+		pc += 2;
+		if (c8e_CPU::EndsBlock(op.handler))
+		{
+			break;
+		}
+	}
+
+	u8* entry = m_emit;
+	Forget();
+
+	// leave to the interpreter if the whole block doesn't fit in the budget
+	Emit8(0x41); Emit8(0x81); Emit8(0xef); Emit32(length); // sub r15d, length
+	u8* bail = EmitJccForward(CC_L);
+
+	bool terminated = false;
+	for (int i = 0; i < length && !terminated; i++)
+	{
+		const c8e_Op& op = *ops[i];
+		c8e_OpHandler h = op.handler;
+		u16 next = address + (i + 1) * 2;
+
+		if (h == c8e_CPU::Op_Nop)
+		{
+		}
+		else if (h == c8e_CPU::Op_SetImm)
+		{
+			Reserve(1);
+			EmitMovImm8(Map(op.x), op.nn);
+			m_dirty |= 1 << op.x;
+		}
+		else if (h == c8e_CPU::Op_AddImm)
+		{
+			Reserve(1);
+			EmitRegImm8(0, Map(op.x), op.nn); // add
+			m_dirty |= 1 << op.x;
+		}
+		else if (h == c8e_CPU::Op_Set || h == c8e_CPU::Op_Or || h == c8e_CPU::Op_And || h == c8e_CPU::Op_Xor)
+		{
+			Reserve(2);
+			int rx = Map(op.x);
+			int ry = Map(op.y);
+			u8 opcode = (h == c8e_CPU::Op_Set) ? 0x88 : (h == c8e_CPU::Op_Or) ? 0x08 : (h == c8e_CPU::Op_And) ? 0x20 : 0x30;
+			EmitRegReg8(opcode, ry, rx);
+			m_dirty |= 1 << op.x;
+		}
+		else if (h == c8e_CPU::Op_Add)
+		{
+			Reserve(3);
+			int rx = Map(op.x);
+			int ry = Map(op.y);
+			int rf = Map(0x0f);
+			EmitRegReg8(0x88, rx, RAX); // mov al, Vx
+			EmitRegReg8(0x00, ry, RAX); // add al, Vy
+			EmitSetcc(CC_B, rf); // VF = carry
+			EmitRegReg8(0x88, RAX, rx); // mov Vx, al
+			m_dirty |= (1 << op.x) | (1 << 0x0f);
+		}
+		else if (h == c8e_CPU::Op_Sub || h == c8e_CPU::Op_SubReverse)
+		{
+			Reserve(3);
+			int rx = Map(op.x);
+			int ry = Map(op.y);
+			int rf = Map(0x0f);
+			int minuend = (h == c8e_CPU::Op_Sub) ? rx : ry;
+			int subtrahend = (h == c8e_CPU::Op_Sub) ? ry : rx;
+			EmitRegReg8(0x88, minuend, RAX); // mov al, minuend
+			EmitRegReg8(0x38, subtrahend, RAX); // cmp al, subtrahend
+			EmitSetcc(CC_AE, rf); // VF = no borrow
+			EmitRegReg8(0x88, minuend, RAX); // re-read, VF may be an operand
+			EmitRegReg8(0x28, subtrahend, RAX); // sub al, subtrahend
+			EmitRegReg8(0x88, RAX, rx); // mov Vx, al
+			m_dirty |= (1 << op.x) | (1 << 0x0f);
+		}
+		else if (h == c8e_CPU::Op_ShiftRight || h == c8e_CPU::Op_ShiftLeft)
+		{
+			Reserve(2);
+			int rx = Map(op.x);
+			int rf = Map(0x0f);
+			EmitRegReg8(0x88, rx, RAX); // mov al, Vx
+			if (h == c8e_CPU::Op_ShiftRight)
+			{
+				EmitRegImm8(4, RAX, 0x01); // and al, 1
+			}
+			else
+			{
+				EmitRex(0, RAX, false); Emit8(0xc0); Emit8(0xe8); Emit8(7); // shr al, 7
+			}
+			EmitRegReg8(0x88, RAX, rf); // mov VF, al
+			EmitRex(0, rx, false); Emit8(0xd0); Emit8(0xc0 | ((h == c8e_CPU::Op_ShiftRight ? 5 : 4) << 3) | (rx & 7)); // shr/shl Vx, 1
+			m_dirty |= (1 << op.x) | (1 << 0x0f);
+		}
+		else if (h == c8e_CPU::Op_SetIndex)
+		{
+			EmitMovAbs(RAX, (u64)&m_cpu->m_state.I);
+			Emit8(0x66); Emit8(0xc7); Emit8(0x00); Emit8(op.nnn & 0xff); Emit8(op.nnn >> 8); // mov word [rax], nnn
+		}
+		else if (h == c8e_CPU::Op_AddIndex)
+		{
+			Reserve(2);
+			int rx = Map(op.x);
+			int rf = Map(0x0f);
+			EmitRex(RCX, rx, false); Emit8(0x0f); Emit8(0xb6); Emit8(0xc0 | (RCX << 3) | (rx & 7)); // movzx ecx, Vx
+			EmitMovAbs(RAX, (u64)&m_cpu->m_state.I);
+			Emit8(0x0f); Emit8(0xb7); Emit8(0x10); // movzx edx, word [rax]
+			Emit8(0x01); Emit8(0xca); // add edx, ecx
+			Emit8(0x81); Emit8(0xe2); Emit32(RAM_MASK); // and edx, RAM_MASK
+			Emit8(0x66); Emit8(0x89); Emit8(0x10); // mov [rax], dx
+			EmitMovImm8(rf, 0); // VF = 0, I wraps instead of overflowing
+			m_dirty |= 1 << 0x0f;
+		}
+		else if (h == c8e_CPU::Op_FontChar)
+		{
+			Reserve(1);
+			int rx = Map(op.x);
+			EmitRex(RCX, rx, false); Emit8(0x0f); Emit8(0xb6); Emit8(0xc0 | (RCX << 3) | (rx & 7)); // movzx ecx, Vx
+			Emit8(0x83); Emit8(0xe1); Emit8(0x0f); // and ecx, 15
+			Emit8(0x8d); Emit8(0x0c); Emit8(0x89); // lea ecx, [rcx + rcx * 4]
+			Emit8(0x83); Emit8(0xc1); Emit8(FONT_OFFSET); // add ecx, FONT_OFFSET
+			EmitMovAbs(RAX, (u64)&m_cpu->m_state.I);
+			Emit8(0x66); Emit8(0x89); Emit8(0x08); // mov [rax], cx
+		}
+		else if (h == c8e_CPU::Op_Load && op.x < JIT_HOST_REGISTERS)
+		{
+			Reserve(op.x + 1);
+			int regs[NUM_REGISTERS];
+			for (int v = 0; v <= op.x; v++)
+			{
+				regs[v] = Map(v);
+			}
+			EmitMovAbs(RAX, (u64)&m_cpu->m_state.I);
+			Emit8(0x0f); Emit8(0xb7); Emit8(0x00); // movzx eax, word [rax]
+			EmitMovAbs(RDX, (u64)m_cpu->m_state.ram);
+			for (int v = 0; v <= op.x; v++)
+			{
+				Emit8(0x8d); Emit8(0x48); Emit8((u8)v); // lea ecx, [rax + v]
+				Emit8(0x81); Emit8(0xe1); Emit32(RAM_MASK); // and ecx, RAM_MASK
+				EmitRex(regs[v], RDX, false); Emit8(0x8a); Emit8(0x04 | ((regs[v] & 7) << 3)); Emit8(0x0a); // mov Vv, [rdx + rcx]
+				m_dirty |= 1 << v;
+			}
+		}
+		else if (h == c8e_CPU::Op_ReadDelay || h == c8e_CPU::Op_SetDelay)
+		{
+			Reserve(1);
+			int rx = Map(op.x);
+			EmitMovAbs(RAX, (u64)&m_cpu->m_state.delay);
+			EmitRex(rx, RAX, false); Emit8(h == c8e_CPU::Op_ReadDelay ? 0x8a : 0x88); Emit8((rx & 7) << 3); // mov Vx, [rax] / mov [rax], Vx
+			if (h == c8e_CPU::Op_ReadDelay)
+			{
+				m_dirty |= 1 << op.x;
+			}
+		}
+		else if (h == c8e_CPU::Op_Jump)
+		{
+			WriteBack();
+			EmitExit(op.nnn);
+			terminated = true;
+		}
+		else if (h == c8e_CPU::Op_SkipEqualImm || h == c8e_CPU::Op_SkipNotEqualImm || h == c8e_CPU::Op_SkipEqual || h == c8e_CPU::Op_SkipNotEqual)
+		{
+			Reserve(2);
+			int rx = Map(op.x);
+			if (h == c8e_CPU::Op_SkipEqualImm || h == c8e_CPU::Op_SkipNotEqualImm)
+			{
+				EmitRegImm8(7, rx, op.nn); // cmp Vx, nn
+			}
+			else
+			{
+				EmitRegReg8(0x38, Map(op.y), rx); // cmp Vx, Vy
+			}
+			WriteBack(); // plain movs, flags survive
+			bool skipIfEqual = (h == c8e_CPU::Op_SkipEqualImm || h == c8e_CPU::Op_SkipEqual);
+			u8* skip = EmitJccForward(skipIfEqual ? CC_E : CC_NE);
+			EmitExit(next);
+			PatchForward(skip);
+			EmitExit(next + 2);
+			terminated = true;
+		}
+		else
+		{
+			// no native translation, call the interpreter's handler
+			EmitHelper(op, next);
+			if (c8e_CPU::EndsBlock(h))
+			{
+				EmitJmp(m_exitKeepPC);
+				terminated = true;
+			}
+		}
+	}
+
+	if (!terminated)
+	{
+		WriteBack();
+		EmitExit(pc);
+	}
+
+	PatchForward(bail);
+	Emit8(0x41); Emit8(0x81); Emit8(0xc7); Emit32(length); // add r15d, length
+	Emit8(0xb8); Emit32(address); // mov eax, address
+	EmitJmp(m_exitWithPC);
+
+	for (int i = address; i < pc; i++)
+	{
+		m_cpu->m_codeMap[i] = 1;
+	}
+	m_blockEnd[address] = pc;
+	m_entries[address] = entry;
+	m_compiledBlocks++;
+	return entry;
+}
+
+int c8e_JIT::Map(int v)
+{
+	if (m_hostOf[v] >= 0)
+	{
+		return m_hostOf[v];
+	}
+	for (int slot = 0; slot < JIT_HOST_REGISTERS; slot++)
+	{
+		if (m_guestOf[slot] < 0)
+		{
+			m_guestOf[slot] = v;
+			m_hostOf[v] = s_pool[slot];
+			EmitLoadV(s_pool[slot], v);
+			return s_pool[slot];
+		}
+	}
+	return -1; // callers Reserve first so this can't happen
+}
+
+void c8e_JIT::Reserve(int count)
+{
+	// make sure count more registers can be mapped, spilling everything if not
+	int used = 0;
+	for (int slot = 0; slot < JIT_HOST_REGISTERS; slot++)
+	{
+		used += (m_guestOf[slot] >= 0);
+	}
+	if (used + count > JIT_HOST_REGISTERS)
+	{
+		WriteBack();
+		Forget();
+	}
+}
+
+void c8e_JIT::WriteBack()
+{
+	for (int v = 0; v < NUM_REGISTERS; v++)
+	{
+		if ((m_dirty & (1 << v)) && m_hostOf[v] >= 0)
+		{
+			EmitStoreV(m_hostOf[v], v);
+		}
+	}
+	m_dirty = 0;
+}
+
+void c8e_JIT::Forget()
+{
+	for (int v = 0; v < NUM_REGISTERS; v++)
+	{
+		m_hostOf[v] = -1;
+	}
+	for (int slot = 0; slot < JIT_HOST_REGISTERS; slot++)
+	{
+		m_guestOf[slot] = -1;
+	}
+	m_dirty = 0;
+}
+
+void c8e_JIT::EmitExit(u16 target)
+{
+	// chain through the entry table, uncompiled targets land in m_exitWithPC
+	Emit8(0xb8); Emit32(target); // mov eax, target
+	if (target > RAM_SIZE - 2)
+	{
+		EmitJmp(m_exitWithPC);
+		return;
+	}
+	EmitMovAbs(RCX, (u64)&m_entries[target]);
+	Emit8(0xff); Emit8(0x21); // jmp [rcx]
+}
+
+void c8e_JIT::EmitHelper(const c8e_Op& op, u16 next)
+{
+	WriteBack();
+	Forget();
+	u16 pc = next & RAM_MASK;
+	EmitMovAbs(RAX, (u64)&m_cpu->m_state.pc);
+	Emit8(0x66); Emit8(0xc7); Emit8(0x00); Emit8(pc & 0xff); Emit8(pc >> 8); // mov word [rax], next
+	EmitMovAbs(RDI, (u64)m_cpu);
+	EmitMovAbs(RSI, (u64)&op);
+	EmitMovAbs(RAX, (u64)op.handler);
+	Emit8(0xff); Emit8(0xd0); // call rax
+}
+
+void c8e_JIT::Emit8(u8 value)
+{
+	*m_emit++ = value;
+}
+
+void c8e_JIT::Emit32(unsigned int value)
+{
+	memcpy(m_emit, &value, 4);
+	m_emit += 4;
+}
+
+void c8e_JIT::Emit64(u64 value)
+{
+	memcpy(m_emit, &value, 8);
+	m_emit += 8;
+}
+
+void c8e_JIT::EmitRex(int reg, int rm, bool wide)
+{
+	// always emitted for byte operations so that 4-7 encode spl/bpl/sil/dil
+	Emit8(0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((rm & 8) ? 0x01 : 0));
+}
+
+void c8e_JIT::EmitRegReg8(u8 opcode, int reg, int rm)
+{
+	EmitRex(reg, rm, false);
+	Emit8(opcode);
+	Emit8(0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+void c8e_JIT::EmitRegImm8(u8 extension, int rm, u8 imm)
+{
+	EmitRex(0, rm, false);
+	Emit8(0x80);
+	Emit8(0xc0 | (extension << 3) | (rm & 7));
+	Emit8(imm);
+}
+
+void c8e_JIT::EmitMovImm8(int rm, u8 imm)
+{
+	EmitRex(0, rm, false);
+	Emit8(0xb0 | (rm & 7));
+	Emit8(imm);
+}
+
+void c8e_JIT::EmitSetcc(u8 condition, int rm)
+{
+	EmitRex(0, rm, false);
+	Emit8(0x0f);
+	Emit8(0x90 | condition);
+	Emit8(0xc0 | (rm & 7));
+}
+
+void c8e_JIT::EmitMovAbs(int reg, u64 value)
+{
+	EmitRex(0, reg, true);
+	Emit8(0xb8 | (reg & 7));
+	Emit64(value);
+}
+
+void c8e_JIT::EmitLoadV(int reg, int v)
+{
+	EmitRex(reg, 0, false);
+	Emit8(0x0f); Emit8(0xb6); Emit8(0x40 | ((reg & 7) << 3) | 3); Emit8((u8)v); // movzx reg, byte [rbx + v]
+}
+
+void c8e_JIT::EmitStoreV(int reg, int v)
+{
+	EmitRex(reg, 0, false);
+	Emit8(0x88); Emit8(0x40 | ((reg & 7) << 3) | 3); Emit8((u8)v); // mov [rbx + v], reg
+}
+
+void c8e_JIT::EmitJcc(u8 condition, u8* target)
+{
+	Emit8(0x0f);
+	Emit8(0x80 | condition);
+	Emit32((unsigned int)(target - (m_emit + 4)));
+}
+
+void c8e_JIT::EmitJmp(u8* target)
+{
+	Emit8(0xe9);
+	Emit32((unsigned int)(target - (m_emit + 4)));
+}
+
+u8* c8e_JIT::EmitJccForward(u8 condition)
+{
+	Emit8(0x0f);
+	Emit8(0x80 | condition);
+	u8* site = m_emit;
+	Emit32(0);
+	return site;
+}
+
+void c8e_JIT::PatchForward(u8* site)
+{
+	unsigned int offset = (unsigned int)(m_emit - (site + 4));
+	memcpy(site, &offset, 4);
+}
+
+#endif
\ No newline at end of file
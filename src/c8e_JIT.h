@@ -0,0 +1,77 @@
+#pragma once
+
+#include "c8e_CPU.h"
+
+// The recompiler emits x86-64 System V code, everywhere else ENGINE_JIT runs as ENGINE_BLOCK
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_SUPPORTED
+#endif
+
+#define JIT_CODE_SIZE (1024 * 1024) // executable buffer, flushed completely when full
+#define JIT_HOT_THRESHOLD (16) // visits to an address before its block is compiled
+#define JIT_HOST_REGISTERS (10) // host registers available to hold V registers inside a block
+
+typedef int (*c8e_JitEnter)(u8* V, void* entry, int budget);
+
+// Translates hot basic blocks to native code, anything it can't compile runs through c8e_CPU::Decode
+struct c8e_JIT
+{
+public:
+	c8e_JIT(c8e_CPU* cpu);
+	~c8e_JIT();
+
+	void Run(int count);
+	void Invalidate(int address, int end);
+
+	bool IsReady() { return m_code != NULL; }
+
+	u64 GetCompiledBlocks() { return m_compiledBlocks; }
+
+private:
+	void Reset();
+	void EmitStubs();
+	void* Compile(u16 address);
+
+	// register cache, V registers are loaded on first use and written back at exits and helper calls
+	int Map(int v);
+	void Reserve(int count);
+	void WriteBack();
+	void Forget();
+
+	void EmitExit(u16 target);
+	void EmitHelper(const c8e_Op& op, u16 next);
+
+	// x86-64 encoding
+	void Emit8(u8 value);
+	void Emit32(unsigned int value);
+	void Emit64(u64 value);
+	void EmitRex(int reg, int rm, bool wide);
+	void EmitRegReg8(u8 opcode, int reg, int rm);
+	void EmitRegImm8(u8 extension, int rm, u8 imm);
+	void EmitMovImm8(int rm, u8 imm);
+	void EmitSetcc(u8 condition, int rm);
+	void EmitMovAbs(int reg, u64 value);
+	void EmitLoadV(int reg, int v);
+	void EmitStoreV(int reg, int v);
+	void EmitJcc(u8 condition, u8* target);
+	void EmitJmp(u8* target);
+	u8* EmitJccForward(u8 condition);
+	void PatchForward(u8* site);
+
+	c8e_CPU* m_cpu;
+
+	u8* m_code; // executable buffer
+	u8* m_emit; // next free byte in m_code
+	c8e_JitEnter m_enter; // saves host registers and jumps to a block
+	u8* m_exitKeepPC; // restores host registers and returns the remaining budget
+	u8* m_exitWithPC; // sets the program counter from eax, then exits
+
+	void* m_entries[RAM_SIZE]; // native entry for every address, m_exitWithPC until compiled
+	u16 m_blockEnd[RAM_SIZE]; // end address of the compiled block starting at each address, 0 for none
+	u8 m_hits[RAM_SIZE];
+	u64 m_compiledBlocks = 0;
+
+	int m_hostOf[NUM_REGISTERS]; // host register holding each V register, -1 if not loaded
+	int m_guestOf[JIT_HOST_REGISTERS]; // V register held by each pool slot, -1 if free
+	int m_dirty; // bitmask of V registers changed since loading
+};
\ No newline at end of file
@@ -0,0 +1,233 @@
+#include <fstream>
+#include <string.h>
+
+#include "c8e_Movie.h"
+#include "c8e_SaveFile.h"
+
+#define MOVIE_KEY_DOWN (0x10) // set in an event's key byte for a press
+
+void c8e_Movie::Record(c8e_CPU* cpu)
+{
+	m_events.clear();
+	m_keyframes.clear();
+	m_romChecksum = cpu->GetRomChecksum();
+	m_seed = cpu->GetState().random;
+	m_frames = 0;
+	AddKeyframe(cpu);
+	cpu->SetMovie(this);
+}
+
+void c8e_Movie::RecordKey(u64 cycle, u8 key, bool down)
+{
+	c8e_KeyEvent event;
+	event.cycle = cycle;
+	event.key = key;
+	event.down = down;
+	m_events.push_back(event);
+}
+
+void c8e_Movie::Frame(c8e_CPU* cpu)
+{
+	m_frames++;
+	if (m_frames == MOVIE_KEYFRAME_FRAMES)
+	{
+		m_frames = 0;
+		AddKeyframe(cpu);
+	}
+}
+
+void c8e_Movie::AddKeyframe(c8e_CPU* cpu)
+{
+	m_keyframes.emplace_back();
+	c8e_MovieKeyframe& keyframe = m_keyframes.back();
+	keyframe.cycle = cpu->GetCycleCount();
+	keyframe.event = (u32)m_events.size();
+	keyframe.size = (u32)cpu->SaveState(keyframe.blob, sizeof(keyframe.blob));
+}
+
+bool c8e_Movie::Save(const char* path, c8e_CPU* cpu)
+{
+	m_endCycle = cpu->GetCycleCount();
+
+	// each change is the cycles since the previous one as a 7 bit varint, then the key byte
+	std::vector<u8> events;
+	u64 previous = 0;
+	for (const c8e_KeyEvent& event : m_events)
+	{
+		u64 delta = event.cycle - previous;
+		previous = event.cycle;
+		while (delta >= 0x80)
+		{
+			events.push_back((u8)(delta | 0x80));
+			delta >>= 7;
+		}
+		events.push_back((u8)delta);
+		events.push_back(event.key | (event.down ? MOVIE_KEY_DOWN : 0));
+	}
+
+	c8e_MovieHeader header = {};
+	header.magic = MOVIE_MAGIC;
+	header.version = MOVIE_VERSION;
+	header.headerSize = sizeof(c8e_MovieHeader);
+	header.romChecksum = m_romChecksum;
+	header.seed = m_seed;
+	header.endCycle = m_endCycle;
+	header.keyframes = (u32)m_keyframes.size();
+	header.events = (u32)m_events.size();
+	header.eventBytes = (u32)events.size();
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	file.write((const char*)&header, sizeof(header));
+	for (const c8e_MovieKeyframe& keyframe : m_keyframes)
+	{
+		u8 packed[SAVE_PACKED_MAX];
+		c8e_MovieKeyframeHeader stored;
+		stored.cycle = keyframe.cycle;
+		stored.event = keyframe.event;
+		stored.size = keyframe.size;
+		stored.checksum = c8e_SaveFile::Checksum(keyframe.blob, keyframe.size);
+		stored.packedSize = (u32)c8e_SaveFile::Pack(keyframe.blob, keyframe.size, packed, sizeof(packed));
+		file.write((const char*)&stored, sizeof(stored));
+		file.write((const char*)packed, stored.packedSize);
+	}
+	file.write((const char*)events.data(), events.size());
+	return file.good();
+}
+
+bool c8e_Movie::Load(const char* path)
+{
+	std::ifstream file(path, std::ios::binary);
+	c8e_MovieHeader header;
+	file.read((char*)&header, sizeof(header));
+	if (!file.good() || header.magic != MOVIE_MAGIC || header.version != MOVIE_VERSION || header.headerSize != sizeof(c8e_MovieHeader) || header.keyframes == 0)
+	{
+		return false;
+	}
+
+	m_keyframes.clear();
+	m_keyframes.resize(header.keyframes);
+	for (c8e_MovieKeyframe& keyframe : m_keyframes)
+	{
+		u8 packed[SAVE_PACKED_MAX];
+		c8e_MovieKeyframeHeader stored;
+		file.read((char*)&stored, sizeof(stored));
+		if (!file.good() || stored.packedSize > sizeof(packed) || stored.size > sizeof(keyframe.blob) || stored.event > header.events)
+		{
+			return false;
+		}
+		file.read((char*)packed, stored.packedSize);
+		keyframe.cycle = stored.cycle;
+		keyframe.event = stored.event;
+		keyframe.size = (u32)c8e_SaveFile::Unpack(packed, stored.packedSize, keyframe.blob, sizeof(keyframe.blob));
+		if (!file.good() || keyframe.size != stored.size || c8e_SaveFile::Checksum(keyframe.blob, keyframe.size) != stored.checksum)
+		{
+			return false;
+		}
+	}
+
+	std::vector<u8> events(header.eventBytes);
+	file.read((char*)events.data(), events.size());
+	if ((size_t)file.gcount() != events.size())
+	{
+		return false;
+	}
+	m_events.clear();
+	m_events.reserve(header.events);
+	u64 cycle = 0;
+	size_t read = 0;
+	while (read < events.size() && m_events.size() < header.events)
+	{
+		u64 delta = 0;
+		int shift = 0;
+		while (read < events.size() && (events[read] & 0x80) && shift < 63)
+		{
+			delta |= (u64)(events[read++] & 0x7f) << shift;
+			shift += 7;
+		}
+		if (read + 2 > events.size())
+		{
+			return false;
+		}
+		delta |= (u64)events[read++] << shift;
+		cycle += delta;
+
+		c8e_KeyEvent event;
+		event.cycle = cycle;
+		event.key = events[read] & 0x0f;
+		event.down = (events[read] & MOVIE_KEY_DOWN) != 0;
+		m_events.push_back(event);
+		read++;
+	}
+	if (m_events.size() != header.events)
+	{
+		return false;
+	}
+
+	m_romChecksum = header.romChecksum;
+	m_seed = header.seed;
+	m_endCycle = header.endCycle;
+	m_next = 0;
+	return true;
+}
+
+bool c8e_Movie::Play(c8e_CPU* cpu)
+{
+	if (cpu->GetRomChecksum() != m_romChecksum)
+	{
+		return false;
+	}
+	return Restore(cpu, m_keyframes[0]);
+}
+
+bool c8e_Movie::Restore(c8e_CPU* cpu, const c8e_MovieKeyframe& keyframe)
+{
+	if (!cpu->LoadState(keyframe.blob, keyframe.size))
+	{
+		return false;
+	}
+
+	// LoadState carries queued key changes over, but every change from the keyframe on is queued again from here
+	cpu->ClearKeys();
+	m_next = keyframe.event;
+	return true;
+}
+
+int c8e_Movie::Step(c8e_CPU* cpu, int count)
+{
+	// queue the changes due in this run, the cpu splits the run at each one
+	u64 end = cpu->GetCycleCount() + count;
+	int queued = 0;
+	while (m_next < m_events.size() && m_events[m_next].cycle < end)
+	{
+		if (queued == KEY_EVENT_QUEUE)
+		{
+			end = m_events[m_next].cycle; // the rest wait for the next run rather than overflowing the queue
+			break;
+		}
+		cpu->QueueKey(m_events[m_next]);
+		m_next++;
+		queued++;
+	}
+	return cpu->StepInstructions((int)(end - cpu->GetCycleCount()));
+}
+
+bool c8e_Movie::Seek(c8e_CPU* cpu, u64 cycle)
+{
+	size_t nearest = 0;
+	while (nearest + 1 < m_keyframes.size() && m_keyframes[nearest + 1].cycle <= cycle)
+	{
+		nearest++;
+	}
+	if (!Restore(cpu, m_keyframes[nearest]))
+	{
+		return false;
+	}
+
+	// at most MOVIE_KEYFRAME_FRAMES frames to run, a few milliseconds on any engine
+	while (cpu->GetCycleCount() < cycle)
+	{
+		u64 remaining = cycle - cpu->GetCycleCount();
+		Step(cpu, (remaining < 0x10000) ? (int)remaining : 0x10000);
+	}
+	return true;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <vector>
+
+#include "c8e_CPU.h"
+
+#define MOVIE_MAGIC (0x4d453843) // "C8EM", leads every movie file
+#define MOVIE_VERSION (1)
+#define MOVIE_KEYFRAME_FRAMES (300) // frames between embedded states, bounds how far a seek has to run
+
+// Leads a movie file, the keyframes follow and then the key changes
+struct c8e_MovieHeader
+{
+	u32 magic;
+	u16 version;
+	u16 headerSize;
+	u32 romChecksum; // c8e_CPU::GetRomChecksum of the recording
+	u32 seed; // Cxnn generator when recording started, for reference, the first keyframe holds it
+	u64 endCycle;
+	u32 keyframes;
+	u32 events;
+	u32 eventBytes;
+	u32 padding;
+};
+
+// A state embedded in the movie
+struct c8e_MovieKeyframe
+{
+	u64 cycle;
+	u32 event; // key changes recorded before the state was taken
+	u32 size; // blob bytes
+	u8 blob[STATE_BLOB_SIZE];
+};
+
+// How a keyframe is stored in the file, the blob follows packed by c8e_SaveFile::Pack
+struct c8e_MovieKeyframeHeader
+{
+	u64 cycle;
+	u32 event;
+	u32 size;
+	u32 checksum;
+	u32 packedSize;
+};
+
+// Key changes stamped with the cycle they were applied at, plus the states needed to start anywhere,
+// replaying them from the first keyframe reproduces a run exactly on any engine
+struct c8e_Movie
+{
+public:
+	// recording, called on the thread running the cpu
+	void Record(c8e_CPU* cpu); // starts from the cpu's current state
+	void RecordKey(u64 cycle, u8 key, bool down); // from c8e_CPU as each change is applied
+	void Frame(c8e_CPU* cpu); // after every EVENT_FRAME
+	bool Save(const char* path, c8e_CPU* cpu); // the movie ends at the cpu's current cycle
+
+	// playback
+	bool Load(const char* path);
+	bool Play(c8e_CPU* cpu); // restores the first keyframe, false if the movie was recorded on another rom
+	int Step(c8e_CPU* cpu, int count); // StepInstructions with the recorded key changes queued
+	bool Seek(c8e_CPU* cpu, u64 cycle); // restores the nearest keyframe before cycle, then runs up to it
+	bool IsFinished(c8e_CPU* cpu) { return cpu->GetCycleCount() >= m_endCycle; }
+
+	u64 GetStartCycle() { return m_keyframes.empty() ? 0 : m_keyframes[0].cycle; }
+	u64 GetEndCycle() { return m_endCycle; }
+	size_t GetEvents() { return m_events.size(); }
+	size_t GetKeyframes() { return m_keyframes.size(); }
+
+private:
+	void AddKeyframe(c8e_CPU* cpu);
+	bool Restore(c8e_CPU* cpu, const c8e_MovieKeyframe& keyframe);
+
+	std::vector<c8e_KeyEvent> m_events; // in the order they were applied
+	std::vector<c8e_MovieKeyframe> m_keyframes;
+	u32 m_romChecksum = 0;
+	u32 m_seed = 0;
+	u64 m_endCycle = 0;
+
+	int m_frames = 0; // recording, frames since the last keyframe
+	size_t m_next = 0; // playback, next key change to queue
+};
@@ -0,0 +1,414 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#define NATIVE_SOCKET(s) ((SOCKET)(s))
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#define NATIVE_SOCKET(s) ((int)(s))
+#endif
+
+#include "c8e_Audio.h"
+#include "c8e_Netplay.h"
+#include "c8e_SaveFile.h"
+
+#define NETPLAY_PACKET_HEADER (offsetof(c8e_NetPacket, inputs))
+
+c8e_UdpSocket::c8e_UdpSocket()
+{
+	m_socket = -1;
+#ifdef _WIN32
+	WSADATA data;
+	WSAStartup(MAKEWORD(2, 2), &data);
+#endif
+}
+
+c8e_UdpSocket::~c8e_UdpSocket()
+{
+#ifdef _WIN32
+	if (m_socket != -1)
+	{
+		closesocket(NATIVE_SOCKET(m_socket));
+	}
+	WSACleanup();
+#else
+	if (m_socket != -1)
+	{
+		close(NATIVE_SOCKET(m_socket));
+	}
+#endif
+}
+
+bool c8e_UdpSocket::Open(u16 port)
+{
+#ifdef _WIN32
+	SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (s == INVALID_SOCKET)
+	{
+		return false;
+	}
+	u_long nonblocking = 1;
+	ioctlsocket(s, FIONBIO, &nonblocking);
+	m_socket = (long long)s;
+#else
+	int s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (s < 0)
+	{
+		return false;
+	}
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+	m_socket = s;
+#endif
+
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(port);
+	return bind(s, (const sockaddr*)&address, sizeof(address)) == 0;
+}
+
+bool c8e_UdpSocket::SetPeer(const char* host, u16 port)
+{
+	addrinfo hints = {};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	addrinfo* result = NULL;
+	if (getaddrinfo(host, NULL, &hints, &result) != 0 || !result)
+	{
+		return false;
+	}
+	m_peerAddress = ((const sockaddr_in*)result->ai_addr)->sin_addr.s_addr;
+	m_peerPort = htons(port);
+	freeaddrinfo(result);
+	return true;
+}
+
+bool c8e_UdpSocket::Send(const void* data, size_t size)
+{
+	if (m_socket == -1 || !HasPeer())
+	{
+		return false;
+	}
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = m_peerAddress;
+	address.sin_port = m_peerPort;
+	return sendto(NATIVE_SOCKET(m_socket), (const char*)data, (int)size, 0, (const sockaddr*)&address, sizeof(address)) == (int)size;
+}
+
+int c8e_UdpSocket::Receive(void* data, size_t capacity)
+{
+	if (m_socket == -1)
+	{
+		return 0;
+	}
+	for (;;)
+	{
+		sockaddr_in address;
+		socklen_t length = sizeof(address);
+		int size = (int)recvfrom(NATIVE_SOCKET(m_socket), (char*)data, (int)capacity, 0, (sockaddr*)&address, &length);
+		if (size <= 0)
+		{
+			return 0; // would block, or an error reported for an earlier send
+		}
+		if (!HasPeer())
+		{
+			m_peerAddress = address.sin_addr.s_addr;
+			m_peerPort = address.sin_port;
+		}
+		if (address.sin_addr.s_addr == m_peerAddress && address.sin_port == m_peerPort)
+		{
+			return size;
+		}
+	}
+}
+
+c8e_Netplay::c8e_Netplay(c8e_CPU* cpu)
+{
+	m_cpu = cpu;
+	m_session = cpu->GetRomChecksum() ^ cpu->GetState().random; // so the cpu has to be seeded first
+	for (int i = 0; i < NETPLAY_CHECKSUMS; i++)
+	{
+		m_checksums[i].frame = -1;
+		m_checksums[i].checksum = 0;
+	}
+}
+
+bool c8e_Netplay::Open(u16 port, const char* peer)
+{
+	if (!m_socket.Open(port))
+	{
+		return false;
+	}
+	if (!peer)
+	{
+		return true;
+	}
+
+	const char* colon = strrchr(peer, ':');
+	char host[256];
+	snprintf(host, sizeof(host), "%.*s", colon ? (int)(colon - peer) : (int)strlen(peer), peer);
+	return m_socket.SetPeer(host, colon ? (u16)atoi(colon + 1) : NETPLAY_DEFAULT_PORT);
+}
+
+void c8e_Netplay::SetInputDelay(int frames)
+{
+	// before the first frame, the delayed frames at the start run with no keys
+	m_delay = (frames < 0) ? 0 : (frames > NETPLAY_MAX_DELAY) ? NETPLAY_MAX_DELAY : frames;
+	m_localFrame = m_delay - 1;
+}
+
+void c8e_Netplay::SetConditions(int latencyMs, int lossPercent)
+{
+	m_latency = std::chrono::milliseconds(latencyMs);
+	m_lossPercent = lossPercent;
+}
+
+bool c8e_Netplay::AdvanceFrame(u16 keys)
+{
+	Update();
+
+	// prediction only reaches so far, past that wait for the peer rather than risk a longer rollback
+	if (m_frame - m_remoteFrame > NETPLAY_MAX_ROLLBACK)
+	{
+		m_stalls++;
+		Send();
+		return false;
+	}
+
+	// running ahead of the peer makes it roll back more, so now and then give it a frame to catch up
+	int advantage = m_frame - m_remoteFrame;
+	if (m_frame % NETPLAY_SYNC_INTERVAL == 0 && m_waitFrame != m_frame && advantage - m_remoteAdvantage >= 2)
+	{
+		m_waitFrame = m_frame;
+		m_waits++;
+		Send();
+		return false;
+	}
+
+	m_localFrame = m_frame + m_delay;
+	m_localInputs[m_localFrame & (NETPLAY_INPUT_RING - 1)] = keys;
+	SimulateFrame(m_frame);
+	m_frame++;
+	Send();
+	return true;
+}
+
+void c8e_Netplay::Poll()
+{
+	Update();
+	Send();
+}
+
+void c8e_Netplay::Update()
+{
+	// packets whose simulated latency has passed
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	while (m_delayedTail != m_delayedHead && m_delayed[m_delayedTail & (NETPLAY_DELAY_QUEUE - 1)].due <= now)
+	{
+		const c8e_DelayedPacket& packet = m_delayed[m_delayedTail & (NETPLAY_DELAY_QUEUE - 1)];
+		m_socket.Send(packet.data, packet.size);
+		m_delayedTail++;
+	}
+
+	Receive();
+	Rollback();
+	UpdateChecksums();
+}
+
+void c8e_Netplay::Receive()
+{
+	c8e_NetPacket packet;
+	int size;
+	while ((size = m_socket.Receive(&packet, sizeof(packet))) > 0)
+	{
+		if ((size_t)size < NETPLAY_PACKET_HEADER || packet.magic != NETPLAY_MAGIC || packet.session != m_session
+			|| packet.count > NETPLAY_PACKET_INPUTS || (size_t)size != NETPLAY_PACKET_HEADER + packet.count * sizeof(u16))
+		{
+			continue;
+		}
+		m_received++;
+
+		// only the next frame in order is taken, anything after a gap comes again in a later packet
+		for (int i = 0; i < packet.count; i++)
+		{
+			int frame = packet.frame + i;
+			if (frame != m_remoteFrame + 1 || frame >= m_frame + NETPLAY_INPUT_RING / 2)
+			{
+				continue;
+			}
+			u16 input = packet.inputs[i];
+			m_remoteInputs[frame & (NETPLAY_INPUT_RING - 1)] = input;
+			if (frame < m_frame && m_predicted[frame & (NETPLAY_INPUT_RING - 1)] != input && frame < m_rollbackFrom)
+			{
+				m_rollbackFrom = frame;
+			}
+			m_remoteFrame = frame;
+		}
+
+		if (packet.ack > m_remoteAck)
+		{
+			m_remoteAck = packet.ack;
+		}
+		m_remoteAdvantage = packet.advantage;
+		if (packet.checksumFrame > m_remoteChecksum.frame)
+		{
+			m_remoteChecksum.frame = packet.checksumFrame;
+			m_remoteChecksum.checksum = packet.checksum;
+		}
+	}
+}
+
+void c8e_Netplay::Send()
+{
+	// every input the peer hasn't acknowledged goes in each packet, so a lost one costs nothing extra
+	c8e_NetPacket packet;
+	packet.magic = NETPLAY_MAGIC;
+	packet.session = m_session;
+	packet.frame = m_remoteAck + 1;
+	packet.ack = m_remoteFrame;
+	packet.advantage = m_frame - m_remoteFrame;
+	packet.checksumFrame = (m_latestChecksum >= 0) ? m_checksums[m_latestChecksum].frame : -1;
+	packet.checksum = (m_latestChecksum >= 0) ? m_checksums[m_latestChecksum].checksum : 0;
+	int count = m_localFrame - packet.frame + 1;
+	packet.count = (u16)((count < 0) ? 0 : (count > NETPLAY_PACKET_INPUTS) ? NETPLAY_PACKET_INPUTS : count);
+	for (int i = 0; i < packet.count; i++)
+	{
+		packet.inputs[i] = m_localInputs[(packet.frame + i) & (NETPLAY_INPUT_RING - 1)];
+	}
+	Transmit(&packet, NETPLAY_PACKET_HEADER + packet.count * sizeof(u16));
+}
+
+void c8e_Netplay::Transmit(const void* data, size_t size)
+{
+	if (!m_socket.HasPeer())
+	{
+		return;
+	}
+	m_sent++;
+
+	if (m_lossPercent > 0)
+	{
+		m_lossRandom ^= m_lossRandom << 13;
+		m_lossRandom ^= m_lossRandom >> 17;
+		m_lossRandom ^= m_lossRandom << 5;
+		if ((int)(m_lossRandom % 100) < m_lossPercent)
+		{
+			m_lost++;
+			return;
+		}
+	}
+	if (m_latency.count() == 0)
+	{
+		m_socket.Send(data, size);
+		return;
+	}
+	if (m_delayedHead - m_delayedTail == NETPLAY_DELAY_QUEUE)
+	{
+		m_lost++;
+		return;
+	}
+	c8e_DelayedPacket& packet = m_delayed[m_delayedHead & (NETPLAY_DELAY_QUEUE - 1)];
+	packet.due = std::chrono::steady_clock::now() + m_latency;
+	packet.size = size;
+	memcpy(packet.data, data, size);
+	m_delayedHead++;
+}
+
+u16 c8e_Netplay::GetRemoteInput(int frame)
+{
+	if (m_remoteFrame < 0)
+	{
+		return 0;
+	}
+	return m_remoteInputs[((frame <= m_remoteFrame) ? frame : m_remoteFrame) & (NETPLAY_INPUT_RING - 1)];
+}
+
+void c8e_Netplay::SimulateFrame(int frame)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	m_snapshot[frame & (NETPLAY_SNAPSHOTS - 1)] = m_cpu->GetState();
+	m_snapshotNanoseconds += (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	m_snapshotCount++;
+
+	u16 remote = GetRemoteInput(frame);
+	m_predicted[frame & (NETPLAY_INPUT_RING - 1)] = remote;
+	m_cpu->SetKeys(m_localInputs[frame & (NETPLAY_INPUT_RING - 1)] | remote);
+	m_cpu->StepFrame();
+}
+
+void c8e_Netplay::Rollback()
+{
+	if (m_rollbackFrom >= m_frame)
+	{
+		m_rollbackFrom = INT_MAX;
+		return;
+	}
+
+	// the frames being run again already played their sound, the audio only hears where they end up
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	c8e_Audio* audio = m_cpu->GetAudio();
+	bool sound = m_cpu->GetSoundActive();
+	m_cpu->SetAudio(NULL);
+	m_cpu->SetState(m_snapshot[m_rollbackFrom & (NETPLAY_SNAPSHOTS - 1)]);
+	for (int frame = m_rollbackFrom; frame < m_frame; frame++)
+	{
+		SimulateFrame(frame);
+	}
+	m_cpu->SetAudio(audio);
+	if (audio && m_cpu->GetSoundActive() != sound)
+	{
+		audio->Restart(m_cpu->GetCycleCount(), m_cpu->GetSoundActive());
+	}
+
+	int depth = m_frame - m_rollbackFrom;
+	u64 nanoseconds = (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	m_rollbacks++;
+	m_resimulatedFrames += depth;
+	m_resimulateNanoseconds += nanoseconds;
+	m_maxRollback = (depth > m_maxRollback) ? depth : m_maxRollback;
+	m_maxRollbackNanoseconds = (nanoseconds > m_maxRollbackNanoseconds) ? nanoseconds : m_maxRollbackNanoseconds;
+	m_rollbackFrom = INT_MAX;
+}
+
+void c8e_Netplay::UpdateChecksums()
+{
+	// a snapshot is final once every input before its frame is known and any rollback has run
+	while (m_nextChecksum <= m_remoteFrame + 1 && m_nextChecksum < m_frame)
+	{
+		if (m_frame - m_nextChecksum <= NETPLAY_SNAPSHOTS)
+		{
+			const c8e_State& state = m_snapshot[m_nextChecksum & (NETPLAY_SNAPSHOTS - 1)];
+			m_latestChecksum = (m_nextChecksum / NETPLAY_CHECKSUM_INTERVAL) & (NETPLAY_CHECKSUMS - 1);
+			m_checksums[m_latestChecksum].frame = m_nextChecksum;
+			m_checksums[m_latestChecksum].checksum = c8e_SaveFile::Checksum((const u8*)&state, STATE_HASHED_SIZE);
+		}
+		m_nextChecksum += NETPLAY_CHECKSUM_INTERVAL;
+	}
+
+	if (m_remoteChecksum.frame <= m_comparedFrame)
+	{
+		return;
+	}
+	for (int i = 0; i < NETPLAY_CHECKSUMS; i++)
+	{
+		if (m_checksums[i].frame == m_remoteChecksum.frame)
+		{
+			if (m_checksums[i].checksum != m_remoteChecksum.checksum)
+			{
+				m_desyncs++;
+				printf("Netplay: desync at frame %d\n", m_remoteChecksum.frame);
+			}
+			m_comparedFrame = m_remoteChecksum.frame;
+		}
+	}
+}
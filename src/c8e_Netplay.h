@@ -0,0 +1,151 @@
+#pragma once
+
+#include <chrono>
+#include <climits>
+
+#include "c8e_CPU.h"
+
+#define NETPLAY_MAGIC (0x4e453843) // "C8EN", leads every packet
+#define NETPLAY_DEFAULT_PORT (7264)
+#define NETPLAY_MAX_ROLLBACK (8) // frames run on predicted input before the session stalls for the peer
+#define NETPLAY_MAX_DELAY (8) // frames of input delay, trades latency for fewer rollbacks
+#define NETPLAY_SNAPSHOTS (16) // states kept for rolling back, more than NETPLAY_MAX_ROLLBACK, must be a power of two
+#define NETPLAY_INPUT_RING (128) // frames of input kept per player, must be a power of two
+#define NETPLAY_PACKET_INPUTS (32) // most inputs in one packet, each resends everything the peer hasn't acknowledged
+#define NETPLAY_CHECKSUM_INTERVAL (30) // frames between state checksums exchanged to detect desyncs
+#define NETPLAY_CHECKSUMS (4) // local checksums kept for comparing with late ones from the peer
+#define NETPLAY_SYNC_INTERVAL (10) // frames between chances to wait one out when running ahead of the peer
+#define NETPLAY_DELAY_QUEUE (256) // packets held by the simulated link, must be a power of two
+
+// One datagram, both peers send the same layout in host byte order, only count inputs are sent
+struct c8e_NetPacket
+{
+	u32 magic;
+	u32 session; // rom checksum and seed, packets from a peer running something else are ignored
+	int frame; // frame of inputs[0]
+	int ack; // newest frame of the receiver's input the sender has, with every frame before it
+	int advantage; // frames the sender has run past the newest input it has from the receiver
+	int checksumFrame; // -1 before the first checksum
+	u32 checksum;
+	u16 count;
+	u16 inputs[NETPLAY_PACKET_INPUTS]; // key bits, bit n for key n
+};
+
+// A state checksum taken once every input before its frame was confirmed
+struct c8e_NetChecksum
+{
+	int frame;
+	u32 checksum;
+};
+
+// A packet waiting out the simulated latency
+struct c8e_DelayedPacket
+{
+	std::chrono::steady_clock::time_point due;
+	size_t size;
+	u8 data[sizeof(c8e_NetPacket)];
+};
+
+// Nonblocking UDP socket talking to a single peer
+struct c8e_UdpSocket
+{
+public:
+	c8e_UdpSocket();
+	~c8e_UdpSocket();
+
+	bool Open(u16 port);
+	bool SetPeer(const char* host, u16 port);
+	bool HasPeer() { return m_peerPort != 0; }
+	bool Send(const void* data, size_t size);
+	int Receive(void* data, size_t capacity); // bytes read, 0 when nothing is waiting, the first sender becomes the peer if there isn't one
+
+private:
+	long long m_socket; // SOCKET or a descriptor, -1 when closed
+	u32 m_peerAddress = 0; // network byte order
+	u16 m_peerPort = 0;
+};
+
+// Two player rollback session, each peer runs the same rom on its own c8e_CPU and the keypad is shared.
+// The remote player's input is predicted to repeat, when the real input arrives and differs the cpu is
+// restored from the snapshot before that frame and run forward again with audio detached.
+struct c8e_Netplay
+{
+public:
+	c8e_Netplay(c8e_CPU* cpu);
+
+	bool Open(u16 port, const char* peer); // peer as host:port, NULL to wait for the other side to send first
+	void SetInputDelay(int frames);
+	void SetConditions(int latencyMs, int lossPercent); // simulated link, outgoing packets are held back or dropped
+
+	bool AdvanceFrame(u16 keys); // runs one frame with this player's keys, false when stalled waiting for the peer
+	void Poll(); // receives, rolls back if a prediction was wrong and resends unacknowledged input
+
+	int GetFrame() { return m_frame; }
+	int GetConfirmedFrame() { return (m_remoteFrame < m_frame - 1) ? m_remoteFrame : m_frame - 1; } // newest frame both inputs are known for
+	u64 GetRollbacks() { return m_rollbacks; }
+	int GetMaxRollback() { return m_maxRollback; }
+	double GetAverageRollback() { return m_rollbacks ? (double)m_resimulatedFrames / m_rollbacks : 0.0; } // frames per rollback
+	double GetResimulateTime() { return m_resimulatedFrames ? m_resimulateNanoseconds / 1000.0 / m_resimulatedFrames : 0.0; } // microseconds per frame, restore included
+	double GetMaxRollbackTime() { return m_maxRollbackNanoseconds / 1000.0; } // microseconds
+	double GetSnapshotTime() { return m_snapshotCount ? m_snapshotNanoseconds / (double)m_snapshotCount : 0.0; } // nanoseconds
+	u64 GetStalls() { return m_stalls; }
+	u64 GetWaits() { return m_waits; }
+	u64 GetSent() { return m_sent; }
+	u64 GetReceived() { return m_received; }
+	u64 GetLost() { return m_lost; } // dropped by the simulated link
+	u64 GetDesyncs() { return m_desyncs; }
+
+private:
+	void Update(); // Poll without the send
+	void Receive();
+	void Send();
+	void Transmit(const void* data, size_t size);
+	void Rollback();
+	void SimulateFrame(int frame);
+	void UpdateChecksums();
+	u16 GetRemoteInput(int frame); // predicted to repeat the newest one received
+
+	c8e_CPU* m_cpu;
+	c8e_UdpSocket m_socket;
+	u32 m_session;
+
+	c8e_State m_snapshot[NETPLAY_SNAPSHOTS] = {}; // state before each of the newest frames
+	u16 m_localInputs[NETPLAY_INPUT_RING] = {};
+	u16 m_remoteInputs[NETPLAY_INPUT_RING] = {};
+	u16 m_predicted[NETPLAY_INPUT_RING] = {}; // remote input each frame was last run with
+	int m_frame = 0; // next frame to run
+	int m_delay = 0;
+	int m_localFrame = -1; // newest local input, m_frame + m_delay - 1
+	int m_waitFrame = -1; // frame the last time sync wait happened on
+	int m_remoteFrame = -1; // newest remote input received, with every frame before it
+	int m_remoteAck = -1; // newest local input the peer has
+	int m_remoteAdvantage = 0;
+	int m_rollbackFrom = INT_MAX; // earliest frame run with a wrong prediction
+
+	c8e_NetChecksum m_checksums[NETPLAY_CHECKSUMS];
+	int m_latestChecksum = -1; // index into m_checksums
+	int m_nextChecksum = NETPLAY_CHECKSUM_INTERVAL;
+	c8e_NetChecksum m_remoteChecksum = { -1, 0 };
+	int m_comparedFrame = -1;
+
+	c8e_DelayedPacket m_delayed[NETPLAY_DELAY_QUEUE];
+	u32 m_delayedHead = 0;
+	u32 m_delayedTail = 0;
+	std::chrono::nanoseconds m_latency{ 0 };
+	int m_lossPercent = 0;
+	u32 m_lossRandom = DEFAULT_SEED;
+
+	u64 m_rollbacks = 0;
+	u64 m_resimulatedFrames = 0;
+	int m_maxRollback = 0;
+	u64 m_resimulateNanoseconds = 0;
+	u64 m_maxRollbackNanoseconds = 0;
+	u64 m_snapshotCount = 0;
+	u64 m_snapshotNanoseconds = 0;
+	u64 m_stalls = 0;
+	u64 m_waits = 0;
+	u64 m_sent = 0;
+	u64 m_received = 0;
+	u64 m_lost = 0;
+	u64 m_desyncs = 0;
+};
@@ -0,0 +1,398 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "c8e_Recompiler.h"
+
+#define RECOMPILER_CODE (1 << 0) // an instruction starts here
+#define RECOMPILER_LEADER (1 << 1) // reached other than by falling through, starts a block
+
+// locals and labels of the generated Run, only declared when some block uses them so the output builds warning clean
+#define RECOMPILER_USES_V (1 << 0)
+#define RECOMPILER_USES_RAM (1 << 1)
+#define RECOMPILER_USES_I (1 << 2)
+#define RECOMPILER_USES_DELAY (1 << 3)
+#define RECOMPILER_USES_CODEWRITES (1 << 4)
+#define RECOMPILER_USES_DISPATCH (1 << 5)
+
+c8e_Recompiler::c8e_Recompiler(const char* romName)
+{
+	m_romName = romName;
+	m_cpu = new c8e_CPU(romName, ENGINE_SWITCH);
+	memset(m_flags, 0, sizeof(m_flags));
+	m_worklistSize = 0;
+	m_uses = 0;
+	m_instructions = 0;
+	m_blocks = 0;
+
+	Discover();
+}
+
+c8e_Recompiler::~c8e_Recompiler()
+{
+	delete m_cpu;
+}
+
+void c8e_Recompiler::AddTarget(int address, bool leader)
+{
+	if (address > RAM_SIZE - 2)
+	{
+		return;
+	}
+	if (leader)
+	{
+		m_flags[address] |= RECOMPILER_LEADER;
+	}
+	if (!(m_flags[address] & RECOMPILER_CODE))
+	{
+		m_flags[address] |= RECOMPILER_CODE;
+		m_worklist[m_worklistSize++] = address;
+	}
+}
+
+void c8e_Recompiler::Discover()
+{
+	// follow every statically known path from the entry point, Bnnn targets and returns are left to runtime
+	AddTarget(PROGRAM_OFFSET, true);
+	while (m_worklistSize > 0)
+	{
+		int address = m_worklist[--m_worklistSize];
+		int next = address + 2;
+		m_instructions++;
+
+		const c8e_Op& op = c8e_CPU::LookupOp(*(u16*)(m_cpu->m_state.ram + address));
+		c8e_OpHandler h = op.handler;
+		if (h == c8e_CPU::Op_Jump)
+		{
+			AddTarget(op.nnn, true);
+		}
+		else if (h == c8e_CPU::Op_Call)
+		{
+			AddTarget(op.nnn, true);
+			AddTarget(next, true);
+		}
+		else if (h == c8e_CPU::Op_Return || h == c8e_CPU::Op_JumpOffset)
+		{
+		}
+		else if (h == c8e_CPU::Op_SkipEqualImm || h == c8e_CPU::Op_SkipNotEqualImm || h == c8e_CPU::Op_SkipEqual || h == c8e_CPU::Op_SkipNotEqual
+			|| h == c8e_CPU::Op_SkipKey || h == c8e_CPU::Op_SkipNotKey)
+		{
+			AddTarget(next, true);
+			AddTarget(next + 2, true);
+		}
+		else if (h == c8e_CPU::Op_WaitKey)
+		{
+			// re-executes itself until a key is down
+			AddTarget(address, true);
+			AddTarget(next, true);
+		}
+		else if (c8e_CPU::StartsBlock(h))
+		{
+			// left to the interpreter, the cycle count is only brought up to date once the translation returns
+			m_flags[address] |= RECOMPILER_LEADER;
+			AddTarget(next, true);
+		}
+		else if (c8e_CPU::EndsBlock(h))
+		{
+			// stores may overwrite the code that follows, which is checked at the start of every block
+			AddTarget(next, true);
+		}
+		else
+		{
+			AddTarget(next, false);
+		}
+	}
+
+	for (int address = 0; address < RAM_SIZE; address++)
+	{
+		m_blocks += (m_flags[address] & RECOMPILER_LEADER) != 0;
+	}
+}
+
+bool c8e_Recompiler::Write(const char* sourceName)
+{
+	std::ofstream out(sourceName);
+	if (!out)
+	{
+		return false;
+	}
+
+	const char* baseName = m_romName;
+	for (const char* c = m_romName; *c; c++)
+	{
+		if (*c == '/' || *c == '\\')
+		{
+			baseName = c + 1;
+		}
+	}
+
+	char line[256];
+	out << "// Generated by c8e_Recompiler from " << baseName << ", link it in and run with -engine static\n";
+	out << "#include \"c8e_AOT.h\"\n\n";
+
+	out << "static const u8 s_rom[] = {";
+	for (int i = 0; i < m_cpu->m_romSize; i++)
+	{
+		snprintf(line, sizeof(line), "%s0x%02x,", (i % 16) ? " " : "\n\t", m_cpu->m_state.ram[PROGRAM_OFFSET + i]);
+		out << line;
+	}
+	out << "\n};\n\n";
+
+	// byte ranges of the translated instructions
+	out << "static const u16 s_code[] = {";
+	int ranges = 0;
+	bool inCode = false;
+	for (int address = 0; address <= RAM_SIZE; address++)
+	{
+		bool code = (address < RAM_SIZE) && ((m_flags[address] & RECOMPILER_CODE) || (address > 0 && (m_flags[address - 1] & RECOMPILER_CODE)));
+		if (code != inCode)
+		{
+			snprintf(line, sizeof(line), "%s0x%03x,", inCode ? " " : (ranges % 4) ? "  " : "\n\t", address);
+			out << line;
+			ranges += inCode;
+			inCode = code;
+		}
+	}
+	out << "\n};\n\n";
+
+	// the blocks go first, the declarations depend on what they use
+	std::ostringstream blocks;
+	m_uses = 0;
+	for (int address = 0; address < RAM_SIZE; address++)
+	{
+		if (m_flags[address] & RECOMPILER_LEADER)
+		{
+			WriteBlock(blocks, address);
+		}
+	}
+
+	out << "static int Run(c8e_CPU* cpu, int budget)\n{\n";
+	if (m_uses & RECOMPILER_USES_V)
+	{
+		out << "\tu8* V = c8e_AOT::V(cpu);\n";
+	}
+	if (m_uses & RECOMPILER_USES_RAM)
+	{
+		out << "\tu8* ram = c8e_AOT::Ram(cpu);\n";
+	}
+	if (m_uses & RECOMPILER_USES_I)
+	{
+		out << "\tu16& I = c8e_AOT::I(cpu);\n";
+	}
+	if (m_uses & RECOMPILER_USES_DELAY)
+	{
+		out << "\tu8& delay = c8e_AOT::Delay(cpu);\n";
+	}
+	if (m_uses & RECOMPILER_USES_CODEWRITES)
+	{
+		out << "\tconst u64& codeWrites = c8e_AOT::CodeWrites(cpu);\n";
+	}
+	out << "\tint pc = c8e_AOT::GetPC(cpu);\n\n";
+
+	if (m_uses & RECOMPILER_USES_DISPATCH)
+	{
+		out << "dispatch:\n";
+	}
+	out << "\tswitch (pc)\n\t{\n";
+	for (int address = 0; address < RAM_SIZE; address++)
+	{
+		if (m_flags[address] & RECOMPILER_LEADER)
+		{
+			snprintf(line, sizeof(line), "\t\tcase 0x%03x: goto L_%03x;\n", address, address);
+			out << line;
+		}
+	}
+	out << "\t\tdefault: goto leave;\n\t}\n";
+	out << blocks.str();
+
+	out << "\nleave:\n\tc8e_AOT::SetPC(cpu, pc);\n\treturn budget;\n}\n\n";
+
+	snprintf(line, sizeof(line), "static c8e_AOTProgram s_program = { \"%s\", s_rom, sizeof(s_rom), s_code, %d, Run, NULL };\n", baseName, ranges);
+	out << line;
+	out << "static c8e_AOTRegistration s_registration(&s_program);\n";
+	return (bool)out;
+}
+
+void c8e_Recompiler::WriteBlock(std::ostream& out, int start)
+{
+	char line[256];
+	u16 first = *(u16*)(m_cpu->m_state.ram + start);
+	if (c8e_CPU::StartsBlock(c8e_CPU::LookupOp(first).handler))
+	{
+		snprintf(line, sizeof(line), "\nL_%03x:\n\tpc = 0x%03x; goto leave; // %04x, run by the interpreter\n", start, start, (u16)((first >> 8) | (first << 8)));
+		out << line;
+		return;
+	}
+
+	// a block runs from a leader up to the next leader or an instruction that ends it
+	int end = start;
+	int length = 0;
+	bool terminated = false;
+	while (end <= RAM_SIZE - 2 && (m_flags[end] & RECOMPILER_CODE) && (end == start || !(m_flags[end] & RECOMPILER_LEADER)))
+	{
+		length++;
+		terminated = c8e_CPU::EndsBlock(c8e_CPU::LookupOp(*(u16*)(m_cpu->m_state.ram + end)).handler);
+		end += 2;
+		if (terminated)
+		{
+			break;
+		}
+	}
+
+	snprintf(line, sizeof(line), "\nL_%03x:\n\tif (budget < %d || (codeWrites && c8e_AOT::IsStale(cpu, 0x%03x, 0x%03x))) { pc = 0x%03x; goto leave; }\n\tbudget -= %d;\n",
+		start, length, start, end, start, length);
+	out << line;
+	m_uses |= RECOMPILER_USES_CODEWRITES;
+
+	for (int address = start; address < end; address += 2)
+	{
+		u16 opcode = *(u16*)(m_cpu->m_state.ram + address);
+		WriteOp(out, address, opcode, c8e_CPU::LookupOp(opcode));
+	}
+	if (!terminated)
+	{
+		out << "\t" << Goto(end) << "\n";
+	}
+}
+
+std::string c8e_Recompiler::Goto(int target)
+{
+	char line[64];
+	if (target <= RAM_SIZE - 2 && (m_flags[target] & RECOMPILER_LEADER))
+	{
+		snprintf(line, sizeof(line), "goto L_%03x;", target);
+	}
+	else
+	{
+		snprintf(line, sizeof(line), "{ pc = 0x%03x; goto leave; }", target);
+	}
+	return line;
+}
+
+void c8e_Recompiler::WriteOp(std::ostream& out, int address, u16 opcode, const c8e_Op& op)
+{
+	// opcodes are stored big endian, print them the way they are written
+	u16 word = (u16)((opcode >> 8) | (opcode << 8));
+	c8e_OpHandler h = op.handler;
+	int next = address + 2;
+	int x = op.x;
+	int y = op.y;
+	char line[512];
+
+	if (h == c8e_CPU::Op_Nop)
+	{
+		snprintf(line, sizeof(line), "\t// %04x: machine code routine, ignored\n", word);
+	}
+	else if (h == c8e_CPU::Op_SetImm)
+	{
+		snprintf(line, sizeof(line), "\tV[0x%x] = 0x%02x; // %04x\n", x, op.nn, word);
+		m_uses |= RECOMPILER_USES_V;
+	}
+	else if (h == c8e_CPU::Op_AddImm)
+	{
+		snprintf(line, sizeof(line), "\tV[0x%x] += 0x%02x; // %04x\n", x, op.nn, word);
+		m_uses |= RECOMPILER_USES_V;
+	}
+	else if (h == c8e_CPU::Op_Set)
+	{
+		snprintf(line, sizeof(line), "\tV[0x%x] = V[0x%x]; // %04x\n", x, y, word);
+		m_uses |= RECOMPILER_USES_V;
+	}
+	else if (h == c8e_CPU::Op_Or || h == c8e_CPU::Op_And || h == c8e_CPU::Op_Xor)
+	{
+		const char* sign = (h == c8e_CPU::Op_Or) ? "|" : (h == c8e_CPU::Op_And) ? "&" : "^";
+		snprintf(line, sizeof(line), "\tV[0x%x] %s= V[0x%x]; // %04x\n", x, sign, y, word);
+		m_uses |= RECOMPILER_USES_V;
+	}
+	else if (h == c8e_CPU::Op_Add)
+	{
+		snprintf(line, sizeof(line), "\t{ u8 val = V[0x%x] + V[0x%x]; V[0xf] = (val < V[0x%x]) || (val < V[0x%x]); V[0x%x] = val; } // %04x\n", x, y, x, y, x, word);
+		m_uses |= RECOMPILER_USES_V;
+	}
+	else if (h == c8e_CPU::Op_Sub || h == c8e_CPU::Op_SubReverse)
+	{
+		int a = (h == c8e_CPU::Op_Sub) ? x : y;
+		int b = (h == c8e_CPU::Op_Sub) ? y : x;
+		snprintf(line, sizeof(line), "\tV[0xf] = (V[0x%x] >= V[0x%x]); V[0x%x] = V[0x%x] - V[0x%x]; // %04x\n", a, b, x, a, b, word);
+		m_uses |= RECOMPILER_USES_V;
+	}
+	else if (h == c8e_CPU::Op_ShiftRight)
+	{
+		snprintf(line, sizeof(line), "\tV[0xf] = V[0x%x] & 0x01; V[0x%x] = V[0x%x] >> 1; // %04x\n", x, x, x, word);
+		m_uses |= RECOMPILER_USES_V;
+	}
+	else if (h == c8e_CPU::Op_ShiftLeft)
+	{
+		snprintf(line, sizeof(line), "\tV[0xf] = (V[0x%x] & 0x80) > 0; V[0x%x] = V[0x%x] << 1; // %04x\n", x, x, x, word);
+		m_uses |= RECOMPILER_USES_V;
+	}
+	else if (h == c8e_CPU::Op_SetIndex)
+	{
+		snprintf(line, sizeof(line), "\tI = 0x%03x; // %04x\n", op.nnn, word);
+		m_uses |= RECOMPILER_USES_I;
+	}
+	else if (h == c8e_CPU::Op_ReadDelay)
+	{
+		snprintf(line, sizeof(line), "\tV[0x%x] = delay; // %04x\n", x, word);
+		m_uses |= RECOMPILER_USES_V | RECOMPILER_USES_DELAY;
+	}
+	else if (h == c8e_CPU::Op_SetDelay)
+	{
+		snprintf(line, sizeof(line), "\tdelay = V[0x%x]; // %04x\n", x, word);
+		m_uses |= RECOMPILER_USES_V | RECOMPILER_USES_DELAY;
+	}
+	else if (h == c8e_CPU::Op_AddIndex)
+	{
+		snprintf(line, sizeof(line), "\tI = (I + V[0x%x]) & RAM_MASK; V[0xf] = 0; // %04x\n", x, word);
+		m_uses |= RECOMPILER_USES_V | RECOMPILER_USES_I;
+	}
+	else if (h == c8e_CPU::Op_FontChar)
+	{
+		snprintf(line, sizeof(line), "\tI = FONT_OFFSET + (u8)((V[0x%x] & 0x0F) * FONT_HEIGHT); // %04x\n", x, word);
+		m_uses |= RECOMPILER_USES_V | RECOMPILER_USES_I;
+	}
+	else if (h == c8e_CPU::Op_Load)
+	{
+		int length = snprintf(line, sizeof(line), "\t");
+		for (int i = 0; i <= x; i++)
+		{
+			length += snprintf(line + length, sizeof(line) - length, "V[0x%x] = ram[(I + %d) & RAM_MASK]; ", i, i);
+		}
+		snprintf(line + length, sizeof(line) - length, "// %04x\n", word);
+		m_uses |= RECOMPILER_USES_V | RECOMPILER_USES_RAM | RECOMPILER_USES_I;
+	}
+	else if (h == c8e_CPU::Op_Jump)
+	{
+		snprintf(line, sizeof(line), "\t%s // %04x\n", Goto(op.nnn).c_str(), word);
+	}
+	else if (h == c8e_CPU::Op_Call)
+	{
+		snprintf(line, sizeof(line), "\tc8e_AOT::Call(cpu, 0x%04x, 0x%03x); %s // %04x\n", opcode, next, Goto(op.nnn).c_str(), word);
+	}
+	else if (h == c8e_CPU::Op_SkipEqualImm || h == c8e_CPU::Op_SkipNotEqualImm)
+	{
+		snprintf(line, sizeof(line), "\tif (V[0x%x] %s 0x%02x) %s // %04x\n\t%s\n",
+			x, (h == c8e_CPU::Op_SkipEqualImm) ? "==" : "!=", op.nn, Goto(next + 2).c_str(), word, Goto(next).c_str());
+		m_uses |= RECOMPILER_USES_V;
+	}
+	else if (h == c8e_CPU::Op_SkipEqual || h == c8e_CPU::Op_SkipNotEqual)
+	{
+		snprintf(line, sizeof(line), "\tif (V[0x%x] %s V[0x%x]) %s // %04x\n\t%s\n",
+			x, (h == c8e_CPU::Op_SkipEqual) ? "==" : "!=", y, Goto(next + 2).c_str(), word, Goto(next).c_str());
+		m_uses |= RECOMPILER_USES_V;
+	}
+	else if (h == c8e_CPU::Op_BCD || h == c8e_CPU::Op_Store)
+	{
+		snprintf(line, sizeof(line), "\tc8e_AOT::Call(cpu, 0x%04x, 0x%03x); %s // %04x\n", opcode, next, Goto(next).c_str(), word);
+	}
+	else if (c8e_CPU::EndsBlock(h))
+	{
+		// returns, Bnnn, key skips and Fx0A leave the program counter in the cpu
+		snprintf(line, sizeof(line), "\tc8e_AOT::Call(cpu, 0x%04x, 0x%03x); pc = c8e_AOT::GetPC(cpu); goto dispatch; // %04x\n", opcode, next, word);
+		m_uses |= RECOMPILER_USES_DISPATCH;
+	}
+	else
+	{
+		snprintf(line, sizeof(line), "\tc8e_AOT::Call(cpu, 0x%04x, 0x%03x); // %04x\n", opcode, next, word);
+	}
+	out << line;
+}
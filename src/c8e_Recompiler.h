@@ -0,0 +1,39 @@
+#pragma once
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "c8e_CPU.h"
+
+// Translates a rom to a C++ source file that registers itself with c8e_AOT, for ENGINE_STATIC
+struct c8e_Recompiler
+{
+public:
+	c8e_Recompiler(const char* romName);
+	~c8e_Recompiler();
+
+	bool Write(const char* sourceName);
+
+	int GetInstructionCount() { return m_instructions; }
+	int GetBlockCount() { return m_blocks; }
+
+private:
+	void Discover();
+	void AddTarget(int address, bool leader);
+
+	void WriteBlock(std::ostream& out, int start);
+	void WriteOp(std::ostream& out, int address, u16 opcode, const c8e_Op& op);
+	std::string Goto(int target);
+
+	const char* m_romName;
+	c8e_CPU* m_cpu; // loads the rom, its ram is only read
+
+	u8 m_flags[RAM_SIZE]; // RECOMPILER_* flags for every address
+	int m_worklist[RAM_SIZE];
+	int m_worklistSize;
+	int m_uses; // RECOMPILER_USES_* for what the blocks written so far need declared
+
+	int m_instructions;
+	int m_blocks;
+};
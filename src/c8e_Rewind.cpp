@@ -0,0 +1,210 @@
+#include <chrono>
+#include <stdlib.h>
+#include <string.h>
+
+#include "c8e_Rewind.h"
+
+static const c8e_State s_empty = {};
+
+static inline u64 LoadWord(const u8* data, size_t word)
+{
+	u64 value;
+	memcpy(&value, data + word * sizeof(u64), sizeof(u64));
+	return value;
+}
+
+c8e_Rewind::c8e_Rewind()
+{
+	m_buffer = (u8*)malloc(REWIND_BUFFER_SIZE);
+}
+
+c8e_Rewind::~c8e_Rewind()
+{
+	free(m_buffer);
+}
+
+void c8e_Rewind::Clear()
+{
+	m_head = 0;
+	m_tail = 0;
+	m_writeOffset = 0;
+}
+
+void c8e_Rewind::Capture(const c8e_State& state)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	// a full history loses its oldest keyframe and everything depending on it
+	while (GetFrames() >= REWIND_SECONDS * TIMERSPEED)
+	{
+		EvictGroup();
+	}
+
+	u8 encoded[REWIND_MAX_ENTRY];
+	u16 sinceKey = (m_head != m_tail) ? Newest().sinceKey + 1 : 0;
+	if (sinceKey >= REWIND_KEYFRAME_INTERVAL)
+	{
+		sinceKey = 0;
+	}
+	size_t size = Encode(state, sinceKey ? &m_key : &s_empty, encoded);
+	if (!Store(encoded, size, sinceKey))
+	{
+		// making room evicted the keyframe this delta needs, so it starts a new group
+		sinceKey = 0;
+		size = Encode(state, &s_empty, encoded);
+		Store(encoded, size, sinceKey);
+	}
+	if (sinceKey == 0)
+	{
+		m_key = state;
+	}
+
+	m_captureNanoseconds += (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	m_captures++;
+}
+
+bool c8e_Rewind::Step(c8e_State& state)
+{
+	if (m_head == m_tail)
+	{
+		return false;
+	}
+
+	c8e_RewindEntry entry = Newest();
+	m_head--;
+	m_writeOffset = entry.offset;
+	if (entry.sinceKey != 0)
+	{
+		state = m_key;
+		Decode(m_buffer + entry.offset, entry.size, state);
+		return true;
+	}
+
+	// stepped back over a keyframe, the entries before it are deltas against the previous one
+	state = m_key;
+	if (m_head != m_tail)
+	{
+		const c8e_RewindEntry& key = m_entries[(m_head - 1 - Newest().sinceKey) & (REWIND_MAX_FRAMES - 1)];
+		m_key = s_empty;
+		Decode(m_buffer + key.offset, key.size, m_key);
+	}
+	return true;
+}
+
+bool c8e_Rewind::Store(const u8* data, size_t size, u16 sinceKey)
+{
+	// entries never wrap, the gap left at the end of the buffer holds the oldest history
+	u32 offset = m_writeOffset;
+	if (offset + size > REWIND_BUFFER_SIZE)
+	{
+		while (m_head != m_tail && Oldest().offset >= offset)
+		{
+			EvictGroup();
+		}
+		offset = 0;
+	}
+	while (m_head != m_tail && Oldest().offset >= offset && Oldest().offset < offset + size)
+	{
+		EvictGroup();
+	}
+	if (sinceKey != 0 && m_head == m_tail)
+	{
+		return false;
+	}
+
+	memcpy(m_buffer + offset, data, size);
+	c8e_RewindEntry& entry = m_entries[m_head & (REWIND_MAX_FRAMES - 1)];
+	entry.offset = offset;
+	entry.size = (u32)size;
+	entry.sinceKey = sinceKey;
+	m_head++;
+	m_writeOffset = offset + (u32)size;
+	return true;
+}
+
+void c8e_Rewind::EvictGroup()
+{
+	m_tail++;
+	while (m_tail != m_head && Oldest().sinceKey != 0)
+	{
+		m_tail++;
+	}
+}
+
+size_t c8e_Rewind::Encode(const c8e_State& state, const c8e_State* reference, u8* out)
+{
+	// runs of changed words, each led by the count of unchanged words to skip and the count of changed words
+	const u8* current = (const u8*)&state;
+	const u8* previous = (const u8*)reference;
+	size_t size = 0;
+	size_t word = 0;
+	while (word < REWIND_WORDS)
+	{
+		size_t start = word;
+		while (word < REWIND_WORDS && LoadWord(current, word) == LoadWord(previous, word))
+		{
+			word++;
+		}
+		if (word == REWIND_WORDS)
+		{
+			break;
+		}
+		u16 skip = (u16)(word - start);
+
+		start = word;
+		while (word < REWIND_WORDS && LoadWord(current, word) != LoadWord(previous, word))
+		{
+			word++;
+		}
+		u16 count = (u16)(word - start);
+
+		memcpy(out + size, &skip, sizeof(skip));
+		memcpy(out + size + 2, &count, sizeof(count));
+		size += 4;
+		for (size_t i = start; i < word; i++)
+		{
+			u64 change = LoadWord(current, i) ^ LoadWord(previous, i);
+			memcpy(out + size, &change, sizeof(change));
+			size += sizeof(u64);
+		}
+	}
+	return size;
+}
+
+void c8e_Rewind::Decode(const u8* in, size_t size, c8e_State& state)
+{
+	u8* data = (u8*)&state;
+	size_t word = 0;
+	size_t read = 0;
+	while (read < size)
+	{
+		u16 skip;
+		u16 count;
+		memcpy(&skip, in + read, sizeof(skip));
+		memcpy(&count, in + read + 2, sizeof(count));
+		read += 4;
+		word += skip;
+		for (int i = 0; i < count; i++)
+		{
+			u64 value = LoadWord(data, word) ^ LoadWord(in + read, 0);
+			memcpy(data + word * sizeof(u64), &value, sizeof(value));
+			read += sizeof(u64);
+			word++;
+		}
+	}
+}
+
+size_t c8e_Rewind::GetBytesUsed()
+{
+	if (m_head == m_tail)
+	{
+		return 0;
+	}
+	u32 start = Oldest().offset;
+	return (m_writeOffset > start) ? m_writeOffset - start : REWIND_BUFFER_SIZE - start + m_writeOffset;
+}
+
+double c8e_Rewind::GetCaptureTime()
+{
+	return m_captures ? m_captureNanoseconds / 1000.0 / m_captures : 0.0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "c8e_CPU.h"
+
+#define REWIND_SECONDS (60) // history kept while the buffer has room
+#define REWIND_BUFFER_SIZE (768 * 1024) // bytes of encoded snapshots
+#define REWIND_KEYFRAME_INTERVAL (60) // frames between snapshots stored whole
+#define REWIND_MAX_FRAMES (4096) // entries in the index ring, at least REWIND_SECONDS * TIMERSPEED, must be a power of two
+#define REWIND_WORDS (sizeof(c8e_State) / sizeof(u64))
+#define REWIND_MAX_ENTRY (sizeof(c8e_State) + 4) // worst case encoding, every word changed
+
+// Where one snapshot lives in the byte ring
+struct c8e_RewindEntry
+{
+	u32 offset;
+	u32 size;
+	u16 sinceKey; // frames after the keyframe this is a delta against, 0 for the keyframe itself
+};
+
+// Per-frame history of c8e_State for playing backwards, each frame is XORed against the last keyframe
+// and stored as runs of changed words, keyframes are the same encoding against zero
+struct c8e_Rewind
+{
+public:
+	c8e_Rewind();
+	~c8e_Rewind();
+
+	void Capture(const c8e_State& state); // once per frame
+	bool Step(c8e_State& state); // removes the newest frame and returns it, false when there is no history left
+	void Clear();
+
+	int GetFrames() { return (int)(m_head - m_tail); }
+	size_t GetBytesUsed();
+	double GetCaptureTime(); // average microseconds per Capture
+
+private:
+	static size_t Encode(const c8e_State& state, const c8e_State* reference, u8* out);
+	static void Decode(const u8* in, size_t size, c8e_State& state); // XORs the changes into state
+
+	bool Store(const u8* data, size_t size, u16 sinceKey); // false if a delta lost its keyframe making room
+	void EvictGroup();
+	c8e_RewindEntry& Newest() { return m_entries[(m_head - 1) & (REWIND_MAX_FRAMES - 1)]; }
+	c8e_RewindEntry& Oldest() { return m_entries[m_tail & (REWIND_MAX_FRAMES - 1)]; }
+
+	u8* m_buffer; // REWIND_BUFFER_SIZE bytes, entries are contiguous and in capture order around the ring
+	u32 m_writeOffset = 0; // end of the newest entry
+
+	c8e_RewindEntry m_entries[REWIND_MAX_FRAMES];
+	u32 m_head = 0; // next free entry
+	u32 m_tail = 0; // oldest entry, always a keyframe
+
+	c8e_State m_key = {}; // keyframe the newest entries are deltas against
+
+	u64 m_captureNanoseconds = 0;
+	u64 m_captures = 0;
+};
@@ -0,0 +1,33 @@
+#include <chrono>
+
+#include "c8e_RunAhead.h"
+
+void c8e_RunAhead::SetFrames(int frames)
+{
+	m_frames = (frames < 0) ? 0 : (frames > RUNAHEAD_MAX_FRAMES) ? RUNAHEAD_MAX_FRAMES : frames;
+}
+
+u32 c8e_RunAhead::Run(c8e_CPU* cpu)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	cpu->BeginSpeculation();
+	for (int i = 0; i < m_frames; i++)
+	{
+		cpu->StepFrame();
+	}
+
+	u32 dirtyRows = m_stale ? 0xffffffff : 0;
+	m_stale = false;
+	const u64* rows = cpu->GetRenderRows();
+	for (int y = 0; y < HEIGHT_PIXELS; y++)
+	{
+		dirtyRows |= (u32)(rows[y] != m_rows[y]) << y;
+		m_rows[y] = rows[y];
+	}
+	cpu->EndSpeculation();
+
+	m_nanoseconds += (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	m_runs++;
+	return dirtyRows;
+}
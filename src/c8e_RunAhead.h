@@ -0,0 +1,28 @@
+#pragma once
+
+#include "c8e_CPU.h"
+
+#define RUNAHEAD_MAX_FRAMES (4) // hidden frames run each frame at most
+
+// Shows the screen a few frames early, every real frame the cpu runs on speculatively with the keys it
+// already has and the frame it reaches is presented instead, so a game that reacts late seems to react at once
+struct c8e_RunAhead
+{
+public:
+	void SetFrames(int frames);
+	int GetFrames() { return m_frames; }
+
+	u32 Run(c8e_CPU* cpu); // after each real frame, rows changed since the last run, bit n for row n
+	void Invalidate() { m_stale = true; } // something else was shown, the next run reports every row
+	const u64* GetRenderRows() { return m_rows; }
+
+	double GetRunTime() { return m_runs ? m_nanoseconds / 1000.0 / m_runs : 0.0; } // average microseconds per Run
+
+private:
+	int m_frames = 0;
+	u64 m_rows[HEIGHT_PIXELS] = {};
+	bool m_stale = true;
+
+	u64 m_nanoseconds = 0;
+	u64 m_runs = 0;
+};
@@ -9,11 +9,28 @@
 #define PIXEL_SIZE (20)
 #define SCREEN_WIDTH (PIXEL_SIZE * WIDTH_PIXELS)
 #define SCREEN_HEIGHT (PIXEL_SIZE * HEIGHT_PIXELS)
-#define BACK_COLOUR 0x00, 0x00, 0x00
-#define FORE_COLOUR 0xff, 0xff, 0xff
+#define BACK_COLOUR (0xff000000) // ARGB
+#define FORE_COLOUR (0xffffffff)
+
+#define SPIN_MARGIN_US (1000) // always spin for the final stretch before a deadline
+
+#define KEY_EVENT_BUFFER (64) // key changes held between PopKeyEvent calls, must be a power of two
+
+// Scancode for each keypad key, laid out as
+// 1 2 3 C    1 2 3 4
+// 4 5 6 D    Q W E R
+// 7 8 9 E    A S D F
+// A 0 B F    Z X C V
+static const SDL_Scancode KEYMAP[NUM_KEYS] =
+{
+	SDL_SCANCODE_X, SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3,
+	SDL_SCANCODE_Q, SDL_SCANCODE_W, SDL_SCANCODE_E, SDL_SCANCODE_A,
+	SDL_SCANCODE_S, SDL_SCANCODE_D, SDL_SCANCODE_Z, SDL_SCANCODE_C,
+	SDL_SCANCODE_4, SDL_SCANCODE_R, SDL_SCANCODE_F, SDL_SCANCODE_V,
+};
 
-#define AMPLITUDE (28000)
 #define SAMPLE_RATE (44100)
+#define AUDIO_BUFFER_SAMPLES (256) // about 6 ms per callback
 
 c8e_SDL::c8e_SDL(const char* title)
 {
@@ -48,88 +65,135 @@ c8e_SDL::c8e_SDL(const char* title)
 			{
 				//Initialize renderer color
 				SDL_SetRenderDrawColor(m_renderer, 0xFF, 0xFF, 0xFF, 0xFF);
+
+				//Create the framebuffer texture, nearest neighbour scaling keeps the pixels sharp
+				SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0");
+				m_texture = SDL_CreateTexture(m_renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, WIDTH_PIXELS, HEIGHT_PIXELS);
+				if (m_texture == NULL)
+				{
+					printf("Texture could not be created! SDL Error: %s\n", SDL_GetError());
+				}
 			}
 
 			//Get window surface
 			screenSurface = SDL_GetWindowSurface(m_window);
 
 			//Fill the surface with backcolor
-			SDL_FillRect(screenSurface, NULL, SDL_MapRGB(screenSurface->format, BACK_COLOUR));
+			SDL_FillRect(screenSurface, NULL, SDL_MapRGB(screenSurface->format, (BACK_COLOUR >> 16) & 0xff, (BACK_COLOUR >> 8) & 0xff, BACK_COLOUR & 0xff));
 
 			//Update the surface
 			SDL_UpdateWindowSurface(m_window);
 		}
 
-		// Initialize audio
+		// Initialize audio, the beeper is rendered from sound timer edges so the device runs continuously
 		extern void audio_callback(void *user_data, Uint8 *raw_buffer, int bytes);
 
-		int sample_nr = 0;
+		m_audio = new c8e_Audio(SAMPLE_RATE);
 
 		SDL_AudioSpec want;
 		want.freq = SAMPLE_RATE; // number of samples per second
 		want.format = AUDIO_S16SYS; // sample type (here: signed short i.e. 16 bit)
 		want.channels = 1; // only one channel
-		want.samples = 2048; // buffer-size
+		want.samples = AUDIO_BUFFER_SAMPLES; // buffer-size
 		want.callback = audio_callback; // function SDL calls periodically to refill the buffer
-		want.userdata = &sample_nr; // counter, keeping track of current sample number
+		want.userdata = m_audio; // edges and timeline the callback renders from
 
 		SDL_AudioSpec have;
-		if (SDL_OpenAudio(&want, &have) != 0) SDL_LogError(SDL_LOG_CATEGORY_AUDIO, "Failed to open audio: %s", SDL_GetError());
-		if (want.format != have.format) SDL_LogError(SDL_LOG_CATEGORY_AUDIO, "Failed to get the desired AudioSpec");
+		if (SDL_OpenAudio(&want, &have) != 0)
+		{
+			SDL_LogError(SDL_LOG_CATEGORY_AUDIO, "Failed to open audio: %s", SDL_GetError());
+		}
+		else
+		{
+			if (want.format != have.format) SDL_LogError(SDL_LOG_CATEGORY_AUDIO, "Failed to get the desired AudioSpec");
+			m_audioBufferSamples = have.samples;
+			SDL_PauseAudio(0);
+		}
 	}
 
-	// Keyboard input state
-	m_keys = (bool*)calloc(NUM_KEYS, sizeof(bool));
+	// Key changes since the last PopKeyEvent
+	m_keyEvents = (c8e_InputEvent*)calloc(KEY_EVENT_BUFFER, sizeof(c8e_InputEvent));
+
+	m_palette[0] = BACK_COLOUR;
+	m_palette[1] = FORE_COLOUR;
 }
 
 c8e_SDL::~c8e_SDL()
 {
-	free(m_keys);
+	free(m_keyEvents);
 
 	// Destroy window
+	SDL_DestroyTexture(m_texture);
+	SDL_DestroyRenderer(m_renderer);
 	SDL_DestroyWindow(m_window);
 
-	// Destroy sound
+	// Destroy sound, the callback is stopped before its state goes
 	SDL_CloseAudio();
+	delete(m_audio);
 
 	// Quit SDL subsystems
 	SDL_Quit();
 }
 
-void c8e_SDL::Render(bool* renderData)
+void c8e_SDL::Render(const u64* renderRows, u32 dirtyRows)
 {
-	int xPos = 0;
-	int yPos = 0;
-	int count = 0;
-	while (count < (WIDTH_PIXELS * HEIGHT_PIXELS))
+	if (m_texture == NULL)
 	{
-		// Make a rectangle (pixel)
-		SDL_Rect fillRect = { xPos * PIXEL_SIZE, yPos * PIXEL_SIZE, PIXEL_SIZE, PIXEL_SIZE };
+		return;
+	}
+	if (m_fullRedraw)
+	{
+		dirtyRows = 0xffffffff;
+		m_fullRedraw = false;
+	}
+	if (dirtyRows == 0)
+	{
+		// the last presented frame is still correct
+		m_skippedFrames++;
+		return;
+	}
+	Uint64 startTicks = SDL_GetPerformanceCounter();
 
-		// Set pixel color
-		if (renderData[count])
-		{
-			SDL_SetRenderDrawColor(m_renderer, FORE_COLOUR, 0xff);
-		}
-		else
-		{
-			SDL_SetRenderDrawColor(m_renderer, BACK_COLOUR, 0xff);
-		}
-		SDL_RenderFillRect(m_renderer, &fillRect);
-		count++;
-		if (count % WIDTH_PIXELS == 0)
+	// expand dirty rows to ARGB through the palette, one upload per run of consecutive rows
+	int y = 0;
+	while (y < HEIGHT_PIXELS)
+	{
+		if (!(dirtyRows & (1u << y)))
 		{
-			xPos = 0;
-			yPos++;
+			y++;
+			continue;
 		}
-		else
+		int first = y;
+		for (; y < HEIGHT_PIXELS && (dirtyRows & (1u << y)); y++)
 		{
-			xPos++;
+			Uint32* dest = m_pixels + y * WIDTH_PIXELS;
+			u64 row = renderRows[y];
+			for (int x = 0; x < WIDTH_PIXELS; x++)
+			{
+				dest[x] = m_palette[(row >> (WIDTH_PIXELS - 1 - x)) & 1];
+			}
 		}
+		SDL_Rect rect = { 0, first, WIDTH_PIXELS, y - first };
+		SDL_UpdateTexture(m_texture, &rect, m_pixels + first * WIDTH_PIXELS, WIDTH_PIXELS * sizeof(Uint32));
 	}
 
+	// one scaled copy to the window
+	SDL_RenderCopy(m_renderer, m_texture, NULL, NULL);
+
 	//Update screen
 	SDL_RenderPresent(m_renderer);
+
+	m_renderTicks += SDL_GetPerformanceCounter() - startTicks;
+	m_renderCount++;
+}
+
+double c8e_SDL::GetRenderTime()
+{
+	if (m_renderCount == 0)
+	{
+		return 0.0;
+	}
+	return m_renderTicks * 1000000.0 / (double)SDL_GetPerformanceFrequency() / (double)m_renderCount;
 }
 
 double c8e_SDL::GetDeltaTime()
@@ -140,52 +204,147 @@ double c8e_SDL::GetDeltaTime()
 	return dt;
 }
 
-bool* c8e_SDL::GetKeys()
+void c8e_SDL::PollEvents()
 {
-	SDL_PumpEvents();
-	const Uint8* keys = SDL_GetKeyboardState(NULL);
-
-	m_keys[0x00] = keys[SDL_SCANCODE_X];
-	m_keys[0x01] = keys[SDL_SCANCODE_1];
-	m_keys[0x02] = keys[SDL_SCANCODE_2];
-	m_keys[0x03] = keys[SDL_SCANCODE_3];
-	m_keys[0x04] = keys[SDL_SCANCODE_Q];
-	m_keys[0x05] = keys[SDL_SCANCODE_W];
-	m_keys[0x06] = keys[SDL_SCANCODE_E];
-	m_keys[0x07] = keys[SDL_SCANCODE_A];
-	m_keys[0x08] = keys[SDL_SCANCODE_S];
-	m_keys[0x09] = keys[SDL_SCANCODE_D];
-	m_keys[0x0a] = keys[SDL_SCANCODE_Z];
-	m_keys[0x0b] = keys[SDL_SCANCODE_C];
-	m_keys[0x0c] = keys[SDL_SCANCODE_4];
-	m_keys[0x0d] = keys[SDL_SCANCODE_R];
-	m_keys[0x0e] = keys[SDL_SCANCODE_F];
-	m_keys[0x0f] = keys[SDL_SCANCODE_V];
-
-	m_escape = keys[SDL_SCANCODE_ESCAPE];
-
-	return m_keys;
+	SDL_Event event;
+	while (SDL_PollEvent(&event))
+	{
+		HandleEvent(event);
+	}
 }
 
-void c8e_SDL::PlaySound()
+bool c8e_SDL::PopKeyEvent(c8e_InputEvent& event)
 {
-	SDL_PauseAudio(0);
+	if (m_keyTail == m_keyHead)
+	{
+		return false;
+	}
+	event = m_keyEvents[m_keyTail & (KEY_EVENT_BUFFER - 1)];
+	m_keyTail++;
+	return true;
 }
 
-void c8e_SDL::StopSound()
+void c8e_SDL::HandleEvent(const SDL_Event& event)
 {
-	SDL_PauseAudio(1);
+	if (event.type == SDL_QUIT)
+	{
+		m_quit = true;
+	}
+	else if ((event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) && !event.key.repeat)
+	{
+		bool down = (event.type == SDL_KEYDOWN);
+		SDL_Scancode scancode = event.key.keysym.scancode;
+		if (scancode == SDL_SCANCODE_ESCAPE)
+		{
+			m_escape = m_escape || down;
+		}
+		else if (scancode == SDL_SCANCODE_F5)
+		{
+			m_saveRequested = m_saveRequested || down;
+		}
+		else if (scancode == SDL_SCANCODE_F9)
+		{
+			m_loadRequested = m_loadRequested || down;
+		}
+		else if (scancode == SDL_SCANCODE_BACKSPACE)
+		{
+			m_rewindHeld = down;
+		}
+		for (int key = 0; key < NUM_KEYS; key++)
+		{
+			if (KEYMAP[key] != scancode)
+			{
+				continue;
+			}
+
+			// stamped on arrival, the emulation applies it at the matching cycle
+			if (m_keyHead - m_keyTail == KEY_EVENT_BUFFER)
+			{
+				m_keyTail++; // nobody is reading, drop the oldest
+			}
+			c8e_InputEvent& input = m_keyEvents[m_keyHead & (KEY_EVENT_BUFFER - 1)];
+			input.time = std::chrono::steady_clock::now();
+			input.key = (u8)key;
+			input.down = down;
+			m_keyHead++;
+		}
+	}
+	else if (event.type == SDL_WINDOWEVENT)
+	{
+		switch (event.window.event)
+		{
+			case SDL_WINDOWEVENT_HIDDEN:
+			case SDL_WINDOWEVENT_MINIMIZED:
+			{
+				m_visible = false;
+				break;
+			}
+			case SDL_WINDOWEVENT_SHOWN:
+			case SDL_WINDOWEVENT_RESTORED:
+			case SDL_WINDOWEVENT_EXPOSED:
+			{
+				m_visible = true;
+				m_fullRedraw = true;
+				break;
+			}
+		}
+	}
 }
 
-void audio_callback(void *user_data, Uint8 *raw_buffer, int bytes)
+void c8e_SDL::WaitUntil(Uint64 deadline)
 {
-	Sint16 *buffer = (Sint16*)raw_buffer;
-	int length = bytes / 2; // 2 bytes per sample for AUDIO_S16SYS
-	int &sample_nr(*(int*)user_data);
+	// block in the event queue for most of the wait, then spin to hit the deadline
+	Uint64 frequency = SDL_GetPerformanceFrequency();
+	Uint64 spinMargin = frequency * SPIN_MARGIN_US / 1000000;
+	for (;;)
+	{
+		Uint64 now = SDL_GetPerformanceCounter();
+		if (now >= deadline)
+		{
+			break;
+		}
+
+		Uint64 remaining = deadline - now;
+		if (remaining <= spinMargin + m_sleepSlack)
+		{
+			continue;
+		}
 
-	for (int i = 0; i < length; i++, sample_nr++)
+		int timeout = (int)((remaining - spinMargin - m_sleepSlack) * 1000 / frequency);
+		if (timeout <= 0)
+		{
+			continue;
+		}
+
+		SDL_Event event;
+		if (SDL_WaitEventTimeout(&event, timeout))
+		{
+			HandleEvent(event);
+		}
+		else
+		{
+			// calibrate against how late the timeout actually fired
+			Uint64 slept = SDL_GetPerformanceCounter() - now;
+			Uint64 requested = frequency * timeout / 1000;
+			Uint64 oversleep = (slept > requested) ? (slept - requested) : 0;
+			m_sleepSlack = (m_sleepSlack * 7 + oversleep) / 8;
+		}
+	}
+}
+
+double c8e_SDL::GetAudioLatency()
+{
+	if (!m_audio)
 	{
-		double time = (double)sample_nr / (double)SAMPLE_RATE;
-		buffer[i] = (Sint16)(AMPLITUDE * sin(2.0f * M_PI * 441.0f * time)); // render 441 HZ sine wave
+		return 0.0;
 	}
+
+	// time behind the emulation plus one device buffer
+	return m_audio->GetLag() + m_audioBufferSamples * 1000.0 / SAMPLE_RATE;
+}
+
+void audio_callback(void *user_data, Uint8 *raw_buffer, int bytes)
+{
+	c8e_Audio* audio = (c8e_Audio*)user_data;
+	audio->Render((Sint16*)raw_buffer, bytes / 2); // 2 bytes per sample for AUDIO_S16SYS
 }
\ No newline at end of file
@@ -2,26 +2,61 @@
 
 #include <SDL.h>
 
+#include "c8e_Audio.h"
+#include "c8e_constants.h"
+#include "c8e_Scheduler.h"
+
 struct c8e_SDL
 {
 public:
 	c8e_SDL(const char* title);
 	~c8e_SDL();
 
-	void Render(bool* renderData);
+	void Render(const u64* renderRows, u32 dirtyRows);
 	double GetDeltaTime();
-	bool* GetKeys();
-	bool QuitEmulator() { return m_escape; }
+	void PollEvents();
+	bool PopKeyEvent(c8e_InputEvent& event); // keypad changes in the order they happened
+	bool QuitEmulator() { return m_escape || m_quit; }
+	bool TakeSaveRequest() { bool save = m_saveRequested; m_saveRequested = false; return save; } // F5 pressed since the last call
+	bool TakeLoadRequest() { bool load = m_loadRequested; m_loadRequested = false; return load; } // F9 pressed since the last call
+	bool IsRewinding() { return m_rewindHeld; } // backspace held
+	bool IsVisible() { return m_visible; }
+	double GetRenderTime(); // average microseconds per presented frame
+	u64 GetSkippedFrames() { return m_skippedFrames; }
+
+	void WaitUntil(Uint64 deadline);
 
-	void PlaySound();
-	void StopSound();
+	c8e_Audio* GetAudio() { return m_audio; }
+	double GetAudioLatency(); // milliseconds from a sound edge being emulated to it leaving the device buffer
 
 private:
+	void HandleEvent(const SDL_Event& event);
+
 	SDL_Window* m_window = NULL;
 	SDL_Renderer* m_renderer = NULL;
+	SDL_Texture* m_texture = NULL; // WIDTH_PIXELS x HEIGHT_PIXELS streaming texture, scaled up on present
+	Uint32 m_palette[2]; // ARGB colour of unlit and lit pixels
+	Uint32 m_pixels[WIDTH_PIXELS * HEIGHT_PIXELS]; // staging copy of the texture, only dirty rows are uploaded
+	bool m_fullRedraw = true; // upload every row on the next Render, after the window was shown or exposed
+	u64 m_skippedFrames = 0; // Render calls with nothing changed
+
+	Uint64 m_renderTicks = 0; // performance counter ticks spent in Render
+	Uint64 m_renderCount = 0;
 
 	Uint64 m_prevDelta = SDL_GetPerformanceCounter();
 
-	bool* m_keys;
-	bool m_escape;
+	c8e_InputEvent* m_keyEvents; // ring of keypad changes not yet popped
+	u32 m_keyHead = 0;
+	u32 m_keyTail = 0;
+	bool m_escape = false;
+	bool m_quit = false;
+	bool m_saveRequested = false;
+	bool m_loadRequested = false;
+	bool m_rewindHeld = false;
+	bool m_visible = true; // false while the window is hidden or minimized
+
+	c8e_Audio* m_audio = NULL; // rendered by the audio callback
+	int m_audioBufferSamples = 0;
+
+	Uint64 m_sleepSlack = 0; // measured oversleep of SDL_WaitEventTimeout, in performance counter ticks
 };
\ No newline at end of file
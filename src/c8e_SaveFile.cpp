@@ -0,0 +1,233 @@
+#include <fstream>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+#include "c8e_SaveFile.h"
+
+#define PACK_MIN_RUN (3) // shorter repeats are cheaper as literals
+#define PACK_MAX_RUN (130)
+#define PACK_MAX_LITERAL (128)
+
+size_t c8e_SaveFile::Pack(const u8* src, size_t size, u8* dst, size_t capacity)
+{
+	// control bytes below 128 are followed by that many plus one literals, the rest repeat the next byte
+	size_t in = 0;
+	size_t out = 0;
+	while (in < size)
+	{
+		size_t run = 1;
+		while (in + run < size && run < PACK_MAX_RUN && src[in + run] == src[in])
+		{
+			run++;
+		}
+		if (run >= PACK_MIN_RUN)
+		{
+			if (out + 2 > capacity)
+			{
+				return 0;
+			}
+			dst[out++] = (u8)(run - PACK_MIN_RUN + PACK_MAX_LITERAL);
+			dst[out++] = src[in];
+			in += run;
+			continue;
+		}
+
+		// literals up to the start of the next run
+		size_t start = in;
+		while (in < size && in - start < PACK_MAX_LITERAL)
+		{
+			if (in + 2 < size && src[in] == src[in + 1] && src[in] == src[in + 2])
+			{
+				break;
+			}
+			in++;
+		}
+		size_t length = in - start;
+		if (out + 1 + length > capacity)
+		{
+			return 0;
+		}
+		dst[out++] = (u8)(length - 1);
+		memcpy(dst + out, src + start, length);
+		out += length;
+	}
+	return out;
+}
+
+size_t c8e_SaveFile::Unpack(const u8* src, size_t size, u8* dst, size_t capacity)
+{
+	size_t in = 0;
+	size_t out = 0;
+	while (in < size)
+	{
+		u8 control = src[in++];
+		if (control < PACK_MAX_LITERAL)
+		{
+			size_t length = (size_t)control + 1;
+			if (in + length > size || out + length > capacity)
+			{
+				return 0;
+			}
+			memcpy(dst + out, src + in, length);
+			in += length;
+			out += length;
+		}
+		else
+		{
+			size_t run = (size_t)control - PACK_MAX_LITERAL + PACK_MIN_RUN;
+			if (in >= size || out + run > capacity)
+			{
+				return 0;
+			}
+			memset(dst + out, src[in++], run);
+			out += run;
+		}
+	}
+	return out;
+}
+
+u32 c8e_SaveFile::Checksum(const u8* data, size_t size)
+{
+	u32 hash = 2166136261u;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash = (hash ^ data[i]) * 16777619u;
+	}
+	return hash;
+}
+
+bool c8e_SaveFile::Write(const char* path, const u8* blob, size_t size)
+{
+	u8 packed[SAVE_PACKED_MAX];
+	c8e_SaveFileHeader header;
+	header.magic = SAVE_FILE_MAGIC;
+	header.size = (u32)size;
+	header.checksum = Checksum(blob, size);
+	header.packedSize = (u32)Pack(blob, size, packed, sizeof(packed));
+	if (header.packedSize == 0)
+	{
+		return false;
+	}
+
+	// written beside the old file and renamed over it, so a crash never leaves half a save
+	char temp[SAVE_PATH_MAX + 4];
+	snprintf(temp, sizeof(temp), "%s.tmp", path);
+	{
+		std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+		file.write((const char*)&header, sizeof(header));
+		file.write((const char*)packed, header.packedSize);
+		if (!file.good())
+		{
+			return false;
+		}
+	}
+#ifdef _WIN32
+	// rename won't replace an existing file here, MoveFileEx does without a moment where neither exists
+	return MoveFileExA(temp, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	return rename(temp, path) == 0; // replaces the old file atomically
+#endif
+}
+
+size_t c8e_SaveFile::Read(const char* path, u8* blob, size_t capacity)
+{
+	std::ifstream file(path, std::ios::binary);
+	c8e_SaveFileHeader header;
+	file.read((char*)&header, sizeof(header));
+	if (!file.good() || header.magic != SAVE_FILE_MAGIC || header.size > capacity || header.packedSize > SAVE_PACKED_MAX)
+	{
+		return 0;
+	}
+
+	u8 packed[SAVE_PACKED_MAX];
+	file.read((char*)packed, header.packedSize);
+	if ((u32)file.gcount() != header.packedSize)
+	{
+		return 0;
+	}
+	size_t size = Unpack(packed, header.packedSize, blob, capacity);
+	if (size != header.size || Checksum(blob, size) != header.checksum)
+	{
+		return 0;
+	}
+	return size;
+}
+
+c8e_SaveWriter::c8e_SaveWriter()
+{
+	m_thread = std::thread(&c8e_SaveWriter::Run, this);
+}
+
+c8e_SaveWriter::~c8e_SaveWriter()
+{
+	Finish();
+}
+
+void c8e_SaveWriter::Finish()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+	m_wake.notify_one();
+	if (m_thread.joinable())
+	{
+		m_thread.join();
+	}
+}
+
+bool c8e_SaveWriter::Write(const char* path, const u8* blob, size_t size)
+{
+	u32 head = m_head.load(std::memory_order_relaxed);
+	if (head - m_tail.load(std::memory_order_acquire) == SAVE_QUEUE_SIZE || size > STATE_BLOB_SIZE || strlen(path) >= SAVE_PATH_MAX)
+	{
+		m_dropped++;
+		return false;
+	}
+	c8e_SaveJob& job = m_jobs[head & (SAVE_QUEUE_SIZE - 1)];
+	snprintf(job.path, sizeof(job.path), "%s", path);
+	memcpy(job.blob, blob, size);
+	job.size = size;
+	m_head.store(head + 1, std::memory_order_release);
+
+	// taking the lock orders this with the writer's check before it sleeps, so the wake can't be missed
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+	}
+	m_wake.notify_one();
+	return true;
+}
+
+void c8e_SaveWriter::Run()
+{
+	for (;;)
+	{
+		u32 tail = m_tail.load(std::memory_order_relaxed);
+		if (tail == m_head.load(std::memory_order_acquire))
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (m_stopping)
+			{
+				return; // only once the queue is empty
+			}
+			m_wake.wait(lock, [this, tail] { return m_stopping || m_head.load(std::memory_order_acquire) != tail; });
+			continue;
+		}
+
+		const c8e_SaveJob& job = m_jobs[tail & (SAVE_QUEUE_SIZE - 1)];
+		if (c8e_SaveFile::Write(job.path, job.blob, job.size))
+		{
+			m_written.fetch_add(1, std::memory_order_relaxed);
+		}
+		else
+		{
+			m_failed.fetch_add(1, std::memory_order_relaxed);
+		}
+		m_tail.store(tail + 1, std::memory_order_release);
+	}
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "c8e_CPU.h"
+
+#define SAVE_FILE_MAGIC (0x5a453843) // "C8EZ", leads every save file
+#define SAVE_QUEUE_SIZE (4) // writes waiting for the background thread, must be a power of two
+#define SAVE_PATH_MAX (260)
+#define SAVE_PACKED_MAX (STATE_BLOB_SIZE + STATE_BLOB_SIZE / 128 + 1) // worst case for incompressible input
+
+// Leads a save file, the packed state blob follows
+struct c8e_SaveFileHeader
+{
+	u32 magic;
+	u32 size; // unpacked bytes
+	u32 checksum; // FNV-1a of the unpacked bytes
+	u32 packedSize;
+};
+
+// Save files on disk, run length packed since ram and the framebuffer are mostly empty
+struct c8e_SaveFile
+{
+public:
+	static size_t Pack(const u8* src, size_t size, u8* dst, size_t capacity); // 0 if it doesn't fit
+	static size_t Unpack(const u8* src, size_t size, u8* dst, size_t capacity); // 0 if malformed
+	static u32 Checksum(const u8* data, size_t size);
+
+	static bool Write(const char* path, const u8* blob, size_t size); // blocking
+	static size_t Read(const char* path, u8* blob, size_t capacity); // blocking, 0 on any error
+};
+
+// A state waiting to be written
+struct c8e_SaveJob
+{
+	char path[SAVE_PATH_MAX];
+	u8 blob[STATE_BLOB_SIZE];
+	size_t size;
+};
+
+// Packs and writes save files on its own thread, the emulation only copies the blob into a queue slot
+struct c8e_SaveWriter
+{
+public:
+	c8e_SaveWriter();
+	~c8e_SaveWriter();
+	void Finish(); // waits for every queued write, then stops the thread
+
+	// single producer, false when the queue is full and the save was dropped
+	bool Write(const char* path, const u8* blob, size_t size);
+
+	u64 GetWritten() { return m_written.load(std::memory_order_relaxed); }
+	u64 GetFailed() { return m_failed.load(std::memory_order_relaxed); }
+	u64 GetDropped() { return m_dropped; }
+
+private:
+	void Run();
+
+	c8e_SaveJob m_jobs[SAVE_QUEUE_SIZE];
+	std::atomic<u32> m_head{ 0 }; // written by the producer
+	std::atomic<u32> m_tail{ 0 }; // written by the writer thread
+	u64 m_dropped = 0;
+
+	std::mutex m_mutex; // only guards the sleep, never held during I/O
+	std::condition_variable m_wake;
+	bool m_stopping = false;
+	std::thread m_thread;
+
+	std::atomic<u64> m_written{ 0 };
+	std::atomic<u64> m_failed{ 0 };
+};
@@ -0,0 +1,86 @@
+#include "c8e_Movie.h"
+#include "c8e_Scheduler.h"
+
+#define NANOSECONDS (1000000000ull)
+
+c8e_Scheduler::c8e_Scheduler()
+{
+	Reset();
+}
+
+void c8e_Scheduler::Reset()
+{
+	m_prevTime = std::chrono::steady_clock::now();
+	m_fraction = 0;
+	m_owedCycles = 0;
+	m_droppedCycles = 0;
+}
+
+void c8e_Scheduler::Hold()
+{
+	m_prevTime = std::chrono::steady_clock::now();
+	m_owedCycles = 0;
+}
+
+int c8e_Scheduler::Advance(c8e_CPU* cpu)
+{
+	std::chrono::time_point<std::chrono::steady_clock> now = std::chrono::steady_clock::now();
+	u64 dt = (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_prevTime).count();
+	m_prevTime = now;
+
+	// audio sync nudges the clock by a few parts per thousand
+	if (m_rateAdjust)
+	{
+		dt = (u64)((s64)dt + (s64)dt * m_rateAdjust / 1000000);
+	}
+
+	// convert elapsed nanoseconds to cycles, keeping the remainder for the next call
+	u64 clockspeed = (u64)cpu->GetClockSpeed();
+	m_fraction += dt * clockspeed;
+	m_owedCycles += m_fraction / NANOSECONDS;
+	m_fraction %= NANOSECONDS;
+
+	// after a long stall don't try to catch up on all of it
+	u64 maxLag = clockspeed * SCHEDULER_MAX_LAG_MS / 1000;
+	if (m_owedCycles > maxLag)
+	{
+		m_droppedCycles += m_owedCycles - maxLag;
+		m_owedCycles = maxLag;
+	}
+
+	int burst = (m_owedCycles > SCHEDULER_MAX_BURST) ? SCHEDULER_MAX_BURST : (int)m_owedCycles;
+	if (burst == 0)
+	{
+		return EVENT_NONE;
+	}
+	m_owedCycles -= burst;
+	if (m_replay)
+	{
+		return m_replay->Step(cpu, burst);
+	}
+	return cpu->StepInstructions(burst);
+}
+
+c8e_KeyEvent c8e_Scheduler::Stamp(c8e_CPU* cpu, const c8e_InputEvent& input)
+{
+	// m_prevTime lines up with the cycle after everything owed has run
+	u64 clockspeed = (u64)cpu->GetClockSpeed();
+	u64 cycle = cpu->GetCycleCount() + m_owedCycles;
+	if (input.time >= m_prevTime)
+	{
+		u64 dt = (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(input.time - m_prevTime).count();
+		cycle += dt * clockspeed / NANOSECONDS;
+	}
+	else
+	{
+		u64 dt = (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(m_prevTime - input.time).count();
+		u64 behind = dt * clockspeed / NANOSECONDS;
+		cycle = (behind < cycle) ? cycle - behind : 0;
+	}
+
+	c8e_KeyEvent event;
+	event.cycle = cycle;
+	event.key = input.key;
+	event.down = input.down;
+	return event;
+}
\ No newline at end of file
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <chrono>
+
+#include "c8e_CPU.h"
+
+typedef long long s64;
+
+struct c8e_Movie;
+
+#define SCHEDULER_MAX_BURST (64) // most instructions run by a single Advance call
+#define SCHEDULER_MAX_LAG_MS (200) // owed time beyond this after a stall is dropped
+
+// A key change as seen by the frontend, stamped with the host time it arrived
+struct c8e_InputEvent
+{
+	std::chrono::time_point<std::chrono::steady_clock> time;
+	u8 key;
+	bool down;
+};
+
+// Realtime pacing for c8e_CPU, runs owed instructions against a monotonic clock
+struct c8e_Scheduler
+{
+public:
+	c8e_Scheduler();
+
+	int Advance(c8e_CPU* cpu);
+	void Reset();
+	void Hold(); // forget time elapsed while the emulation was held, it isn't owed afterwards
+	void SetRateAdjust(int ppm) { m_rateAdjust = ppm; } // run the clock this many parts per million fast, negative for slow
+	void SetReplay(c8e_Movie* movie) { m_replay = movie; } // owed instructions run through the movie with its key changes
+	c8e_KeyEvent Stamp(c8e_CPU* cpu, const c8e_InputEvent& input); // the emulated cycle matching a host timestamp
+
+	u64 GetOwedCycles() { return m_owedCycles; }
+	u64 GetDroppedCycles() { return m_droppedCycles; }
+	s64 GetDrift() { return (s64)(m_owedCycles + m_droppedCycles); } // cycles behind the ideal clock
+
+private:
+	std::chrono::time_point<std::chrono::steady_clock> m_prevTime;
+	u64 m_fraction; // fixed point remainder of a cycle, in units of 1/1000000000
+	u64 m_owedCycles; // cycles due but not yet run
+	u64 m_droppedCycles; // cycles skipped by stall clamping since Reset
+	int m_rateAdjust = 0;
+	c8e_Movie* m_replay = NULL;
+};
\ No newline at end of file
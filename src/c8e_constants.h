@@ -1,6 +1,19 @@
 #pragma once
 
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+
 #define WIDTH_PIXELS (64)
 #define HEIGHT_PIXELS (32)
 
-#define NUM_KEYS (16)
\ No newline at end of file
+#define NUM_KEYS (16)
+
+#define RAM_SIZE (4096)
+#define RAM_MASK (RAM_SIZE - 1) // addresses are 12-bit offsets, masking keeps a misbehaving rom inside ram
+#define PROGRAM_OFFSET (512)
+#define STACK_SIZE (16)
+#define NUM_REGISTERS (16)
+#define FONT_OFFSET (80)
+#define FONT_HEIGHT (5)
\ No newline at end of file
@@ -1,43 +1,726 @@
+#include <chrono>
+#include <thread>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "c8e_CPU.h"
+#include "c8e_EmuThread.h"
+#include "c8e_Movie.h"
+#include "c8e_Netplay.h"
+#include "c8e_Recompiler.h"
+#include "c8e_Rewind.h"
+#include "c8e_RunAhead.h"
+#include "c8e_SaveFile.h"
+#include "c8e_Scheduler.h"
 #include "c8e_SDL.h"
 
 // Constants
 #define PROGRAM_TITLE "CHIP-8 Emulator"
 
-int main(int argc, char* args[])
+//#define DEFAULT_ROM "IBMLogo.ch8"
+//#define DEFAULT_ROM "bc_test.ch8"
+#define DEFAULT_ROM "test_opcode.ch8"
+//#define DEFAULT_ROM "rockto.ch8"
+//#define DEFAULT_ROM "RPS.ch8"
+//#define DEFAULT_ROM "cavern.ch8"
+//#define DEFAULT_ROM "chipquarium.ch8"
+//#define DEFAULT_ROM "Breakout.ch8"
+
+// Main loop pacing
+#define PACING_HYBRID (0) // run each frame's budget then sleep until the next frame
+#define PACING_SPIN (1) // poll continuously, lowest latency but uses a full core
+
+int ParseEngine(const char* name)
 {
-	// initialize
-	c8e_SDL* sdl = new c8e_SDL(PROGRAM_TITLE);
-	c8e_CPU* chip8 = new c8e_CPU();
+	if (strcmp(name, "switch") == 0)
+	{
+		return ENGINE_SWITCH;
+	}
+	if (strcmp(name, "threaded") == 0)
+	{
+		return ENGINE_THREADED;
+	}
+	if (strcmp(name, "table") == 0)
+	{
+		return ENGINE_TABLE;
+	}
+	if (strcmp(name, "jit") == 0)
+	{
+		return ENGINE_JIT;
+	}
+	if (strcmp(name, "static") == 0)
+	{
+		return ENGINE_STATIC;
+	}
+	return ENGINE_BLOCK;
+}
+
+int ParseWaveform(const char* name)
+{
+	if (strcmp(name, "square") == 0)
+	{
+		return WAVE_SQUARE;
+	}
+	if (strcmp(name, "triangle") == 0)
+	{
+		return WAVE_TRIANGLE;
+	}
+	return WAVE_SINE;
+}
+
+// Run a rom without a window as fast as possible, for batch jobs, a replay stops at the end of the movie and
+// anything stops early once the program halts
+int RunHeadless(const char* romName, int engine, u64 instructions, u32 seed, c8e_Movie* replay)
+{
+	c8e_CPU* chip8 = new c8e_CPU(romName, engine);
+	chip8->SetSeed(seed);
+	if (replay && !replay->Play(chip8))
+	{
+		printf("%s: the movie was recorded on a different rom\n", romName);
+		delete(chip8);
+		return 1;
+	}
+
+	std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+	u64 frames = 0;
+	u64 traps = 0; // steps that ran an invalid opcode
+	bool halted = false;
+	u64 end = chip8->GetCycleCount() + instructions;
+	if (replay && replay->GetEndCycle() < end)
+	{
+		end = replay->GetEndCycle();
+	}
+	while (chip8->GetCycleCount() < end)
+	{
+		u64 remaining = end - chip8->GetCycleCount();
+		int count = (remaining < DEFAULT_CLOCKSPEED / TIMERSPEED) ? (int)remaining : DEFAULT_CLOCKSPEED / TIMERSPEED;
+		int events = replay ? replay->Step(chip8, count) : chip8->StepInstructions(count);
+		if (events & EVENT_FRAME)
+		{
+			frames++;
+		}
+		if (events & EVENT_TRAP)
+		{
+			traps++;
+		}
+
+		// a wait for a key costs nothing once skipped, but a jump to itself is the end of the program
+		if (events & EVENT_HALT)
+		{
+			halted = true;
+			break;
+		}
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	// runs of the same rom, seed and movie end on the same hash whatever the engine
+	const c8e_State& state = chip8->GetState();
+	printf("%s: %llu instructions, %llu frames in %.3fs (%.2f MIPS), state %08x\n", romName, chip8->GetCycleCount(), frames, seconds, chip8->GetCycleCount() / seconds / 1000000.0, c8e_SaveFile::Checksum((const u8*)&state, STATE_HASHED_SIZE));
+	printf("Idle: %.1f%% of cycles skipped\n", chip8->GetCycleCount() ? chip8->GetIdleCycles() * 100.0 / chip8->GetCycleCount() : 0.0);
+	if (traps)
+	{
+		printf("Trapped: invalid opcodes ran in %llu step%s\n", traps, (traps == 1) ? "" : "s");
+	}
+	if (halted)
+	{
+		printf("Halted at %03x\n", state.pc);
+	}
+
+	delete(chip8);
+	return 0;
+}
+
+void PrintNetplay(const char* name, c8e_Netplay* netplay)
+{
+	printf("%s: %d frames, %llu rollbacks of %.1f frames (max %d), %.2f us per resimulated frame (max %.1f us per rollback), %.0f ns per snapshot\n",
+		name, netplay->GetFrame(), netplay->GetRollbacks(), netplay->GetAverageRollback(), netplay->GetMaxRollback(), netplay->GetResimulateTime(), netplay->GetMaxRollbackTime(), netplay->GetSnapshotTime());
+	printf("%s: %llu stalls, %llu waits, %llu packets sent, %llu received, %llu lost, %llu desyncs\n",
+		name, netplay->GetStalls(), netplay->GetWaits(), netplay->GetSent(), netplay->GetReceived(), netplay->GetLost(), netplay->GetDesyncs());
+}
+
+// Two sessions talking over UDP on this machine through a simulated link, both must end on the same state
+int RunNetplayTest(const char* romName, int engine, int frames, int delay, int latencyMs, int lossPercent)
+{
+	c8e_CPU* cpus[2];
+	c8e_Netplay* sessions[2];
+	for (int i = 0; i < 2; i++)
+	{
+		cpus[i] = new c8e_CPU(romName, engine);
+		sessions[i] = new c8e_Netplay(cpus[i]);
+		sessions[i]->SetInputDelay(delay);
+		sessions[i]->SetConditions(latencyMs, lossPercent);
+	}
+	char peer[32];
+	snprintf(peer, sizeof(peer), "127.0.0.1:%d", NETPLAY_DEFAULT_PORT);
+	if (!sessions[0]->Open(NETPLAY_DEFAULT_PORT, NULL) || !sessions[1]->Open(NETPLAY_DEFAULT_PORT + 1, peer))
+	{
+		printf("Netplay test: could not open ports %d and %d\n", NETPLAY_DEFAULT_PORT, NETPLAY_DEFAULT_PORT + 1);
+		return 1;
+	}
+
+	// each player holds a random key, or none, for a random stretch of frames
+	u32 random[2] = { 0x1234567, 0x89abcdef };
+	u16 keys[2] = { 0, 0 };
+	std::chrono::nanoseconds frameTime(1000000000 / TIMERSPEED);
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point timeout = deadline + frameTime * frames * 2 + std::chrono::seconds(5);
+	while (sessions[0]->GetConfirmedFrame() < frames - 1 || sessions[1]->GetConfirmedFrame() < frames - 1)
+	{
+		for (int i = 0; i < 2; i++)
+		{
+			random[i] ^= random[i] << 13;
+			random[i] ^= random[i] >> 17;
+			random[i] ^= random[i] << 5;
+			if (random[i] % 20 == 0)
+			{
+				keys[i] = (random[i] & 0x100) ? (u16)(1 << ((random[i] >> 4) & 15)) : 0;
+			}
+			if (sessions[i]->GetFrame() < frames)
+			{
+				sessions[i]->AdvanceFrame(keys[i]);
+			}
+			else
+			{
+				sessions[i]->Poll();
+			}
+		}
+
+		deadline += frameTime;
+		if (deadline > timeout)
+		{
+			break;
+		}
+		std::this_thread::sleep_until(deadline);
+	}
+
+	const c8e_State& state0 = cpus[0]->GetState();
+	const c8e_State& state1 = cpus[1]->GetState();
+	bool confirmed = sessions[0]->GetConfirmedFrame() == frames - 1 && sessions[1]->GetConfirmedFrame() == frames - 1;
+	bool match = confirmed && memcmp(&state0, &state1, STATE_HASHED_SIZE) == 0;
+	printf("Netplay test: %s, %d frames, %d frame delay, %d ms latency, %d%% loss: %s\n", romName, frames, delay, latencyMs, lossPercent,
+		!confirmed ? "timed out" : match ? "states match" : "STATES DIFFER");
+	PrintNetplay("Player 1", sessions[0]);
+	PrintNetplay("Player 2", sessions[1]);
+
+	for (int i = 0; i < 2; i++)
+	{
+		delete(sessions[i]);
+		delete(cpus[i]);
+	}
+	return match ? 0 : 1;
+}
+
+// Translate a rom to C++ for ENGINE_STATIC, the output is added to the build by hand
+int Recompile(const char* romName, const char* sourceName)
+{
+	c8e_Recompiler* recompiler = new c8e_Recompiler(romName);
+	bool written = recompiler->Write(sourceName);
+	if (written)
+	{
+		printf("%s: %d instructions in %d blocks written to %s\n", romName, recompiler->GetInstructionCount(), recompiler->GetBlockCount(), sourceName);
+	}
+	else
+	{
+		printf("%s: could not write %s\n", romName, sourceName);
+	}
+
+	delete(recompiler);
+	return written ? 0 : 1;
+}
+
+// Read a save file and hand it to load, false and a message when it can't be used
+bool ReadState(const char* statePath, u8* blob, size_t& size)
+{
+	size = c8e_SaveFile::Read(statePath, blob, STATE_BLOB_SIZE);
+	if (size == 0)
+	{
+		printf("%s: not a save state\n", statePath);
+		return false;
+	}
+	return true;
+}
+
+// Emulation, input and presenting all in one loop
+void RunSingleThread(c8e_SDL* sdl, c8e_CPU* chip8, int pacing, bool audioSync, c8e_SaveWriter* saveWriter, const char* statePath, c8e_Rewind* rewind, c8e_Movie* movie, bool replay, c8e_RunAhead* runAhead)
+{
+	c8e_Scheduler* scheduler = new c8e_Scheduler();
+	if (replay)
+	{
+		scheduler->SetReplay(movie);
+	}
+
+	Uint64 frameTicks = SDL_GetPerformanceFrequency() / TIMERSPEED;
+	Uint64 frameDeadline = SDL_GetPerformanceCounter();
+	Uint64 rewindDeadline = frameDeadline;
+	u32 runAheadRows = 0; // changed rows of run ahead frames not rendered yet
 
 	// run loop cycle
 	for (;;)
 	{
-		chip8->UpdateInput(sdl->GetKeys());
-		
+		sdl->PollEvents();
+		if (sdl->QuitEmulator())
+		{
+			break;
+		}
+
+		c8e_InputEvent input;
+		while (sdl->PopKeyEvent(input))
+		{
+			// a replay only takes the movie's key changes
+			if (!replay)
+			{
+				chip8->QueueKey(scheduler->Stamp(chip8, input));
+			}
+		}
+
+		u8 blob[STATE_BLOB_SIZE];
+		size_t size;
+		if (sdl->TakeSaveRequest())
+		{
+			size = chip8->SaveState(blob, sizeof(blob));
+			saveWriter->Write(statePath, blob, size);
+		}
+		if (sdl->TakeLoadRequest() && !movie && ReadState(statePath, blob, size) && !chip8->LoadState(blob, size))
+		{
+			printf("%s: saved by a different version\n", statePath);
+		}
+
+		if (audioSync)
+		{
+			scheduler->SetRateAdjust(sdl->GetAudio()->GetRateAdjust());
+		}
+		u64 cycles = chip8->GetCycleCount();
+		u64 idleCycles = chip8->GetIdleCycles();
+
+		// Only render 60 times a second, a paced loop iteration is always one frame
+		int events = EVENT_NONE;
+		if (sdl->IsRewinding() && !movie)
+		{
+			// one captured frame back per frame, even when spinning
+			c8e_State state;
+			Uint64 now = SDL_GetPerformanceCounter();
+			if (now >= rewindDeadline && rewind->Step(state))
+			{
+				chip8->SetState(state);
+				rewindDeadline = now + frameTicks;
+				events = EVENT_FRAME;
+			}
+			scheduler->Hold();
+			runAhead->Invalidate();
+		}
+		else
+		{
+			events = scheduler->Advance(chip8);
+			if (events & EVENT_FRAME)
+			{
+				rewind->Capture(chip8->GetState());
+				if (movie && !replay)
+				{
+					movie->Frame(chip8);
+				}
+				if (runAhead->GetFrames())
+				{
+					runAheadRows |= runAhead->Run(chip8);
+				}
+			}
+		}
+		bool frame = (pacing == PACING_HYBRID) || (events & EVENT_FRAME);
+		if (frame && sdl->IsVisible())
+		{
+			if (runAhead->GetFrames() && !sdl->IsRewinding())
+			{
+				sdl->Render(runAhead->GetRenderRows(), runAheadRows);
+				runAheadRows = 0;
+			}
+			else
+			{
+				sdl->Render(chip8->GetRenderRows(), chip8->TakeDirtyRows());
+			}
+		}
+
+		// spinning sleeps too while only idle loops run
+		bool idle = chip8->GetCycleCount() > cycles && chip8->GetCycleCount() - cycles == chip8->GetIdleCycles() - idleCycles;
+		if (pacing == PACING_HYBRID || idle)
+		{
+			frameDeadline += frameTicks;
+			Uint64 now = SDL_GetPerformanceCounter();
+			if (now > frameDeadline + frameTicks)
+			{
+				frameDeadline = now; // fell behind, don't try to catch up on sleeps
+			}
+			sdl->WaitUntil(frameDeadline);
+		}
+	}
+
+	printf("Clock drift: %lld cycles behind, %llu dropped after stalls\n", scheduler->GetDrift(), scheduler->GetDroppedCycles());
+
+	delete(scheduler);
+}
+
+// Emulation on its own thread, this one handles events and input and presents the newest frame
+void RunEmuThread(c8e_SDL* sdl, c8e_CPU* chip8, int pacing, bool audioSync, c8e_SaveWriter* saveWriter, const char* statePath, c8e_Rewind* rewind, c8e_Movie* movie, bool replay, c8e_RunAhead* runAhead)
+{
+	c8e_EmuThread* emu = new c8e_EmuThread(chip8, pacing == PACING_SPIN);
+	if (audioSync)
+	{
+		emu->SetAudioSync(sdl->GetAudio());
+	}
+	emu->SetSaveFile(saveWriter, statePath);
+	emu->SetRunAhead(runAhead);
+	if (movie)
+	{
+		emu->SetMovie(movie, replay);
+	}
+	else
+	{
+		emu->SetRewind(rewind);
+	}
+	emu->Start();
+
+	Uint64 frameTicks = SDL_GetPerformanceFrequency() / TIMERSPEED;
+	Uint64 frameDeadline = SDL_GetPerformanceCounter();
+	for (;;)
+	{
+		sdl->PollEvents();
+		if (sdl->QuitEmulator())
+		{
+			break;
+		}
+
+		// the emulation thread stamps each one to the cycle it happened at
+		c8e_InputEvent input;
+		while (sdl->PopKeyEvent(input))
+		{
+			emu->PushKey(input); // only full if the emulation thread stalled through 64 changes
+		}
+
+		emu->SetRewinding(sdl->IsRewinding());
+
+		// the file is read here, the emulation thread only copies the state in
+		if (sdl->TakeSaveRequest())
+		{
+			emu->RequestSave();
+		}
+		u8 blob[STATE_BLOB_SIZE];
+		size_t size;
+		if (sdl->TakeLoadRequest() && !movie && ReadState(statePath, blob, size))
+		{
+			emu->PushState(blob, size);
+		}
+
+		// presenting may block on vsync, the emulation thread carries on regardless
+		const c8e_Frame* frame = emu->AcquireFrame();
+		if (frame && sdl->IsVisible())
+		{
+			sdl->Render(frame->rows, frame->dirtyRows);
+		}
+
+		if (pacing == PACING_HYBRID)
+		{
+			frameDeadline += frameTicks;
+			Uint64 now = SDL_GetPerformanceCounter();
+			if (now > frameDeadline + frameTicks)
+			{
+				frameDeadline = now;
+			}
+			sdl->WaitUntil(frameDeadline);
+		}
+	}
+
+	emu->Stop();
+	printf("Clock drift: %lld cycles behind, %llu dropped after stalls, %llu frames not presented\n", emu->GetDrift(), emu->GetDroppedCycles(), emu->GetDroppedFrames());
+
+	delete(emu);
+}
+
+// Lockstep with a netplay peer, one frame per iteration, the session rolls back when the peer's keys arrive late
+void RunNetplay(c8e_SDL* sdl, c8e_CPU* chip8, c8e_Netplay* netplay)
+{
+	Uint64 frameTicks = SDL_GetPerformanceFrequency() / TIMERSPEED;
+	Uint64 frameDeadline = SDL_GetPerformanceCounter();
+	u16 keys = 0;
+	for (;;)
+	{
+		sdl->PollEvents();
 		if (sdl->QuitEmulator())
 		{
 			break;
 		}
 
-		if (chip8->AdvanceTime())
+		// only whole frames are exchanged, so key changes land on frame boundaries
+		c8e_InputEvent input;
+		while (sdl->PopKeyEvent(input))
+		{
+			keys = input.down ? (keys | (1 << input.key)) : (keys & ~(1 << input.key));
+		}
+
+		if (netplay->AdvanceFrame(keys) && sdl->IsVisible())
+		{
+			sdl->Render(chip8->GetRenderRows(), chip8->TakeDirtyRows());
+		}
+
+		frameDeadline += frameTicks;
+		Uint64 now = SDL_GetPerformanceCounter();
+		if (now > frameDeadline + frameTicks)
+		{
+			frameDeadline = now;
+		}
+		sdl->WaitUntil(frameDeadline);
+	}
+
+	PrintNetplay("Netplay", netplay);
+}
+
+int main(int argc, char* args[])
+{
+	// usage: [rom] [-headless instructions] [-spin] [-singlethread] [-audiosync] [-engine switch|block|threaded|table|jit|static] [-recompile source.cpp] [-wave sine|square|triangle] [-pitch hz] [-state file] [-resume] [-seed n] [-record movie] [-replay movie] [-seek frame] [-netplay port] [-peer host:port] [-delay frames] [-netsim latencyms loss%] [-netplaytest frames] [-runahead frames]
+	const char* romName = DEFAULT_ROM;
+	const char* recompileName = NULL;
+	const char* stateName = NULL; // F5 saves and F9 loads, rom name plus .state by default
+	bool resume = false;
+	u32 seed = 0; // Cxnn generator, 0 for the default
+	const char* recordName = NULL;
+	const char* replayName = NULL;
+	u64 seekFrame = 0; // frames into the replay to start from
+	int netplayPort = 0; // two player rollback session when set
+	const char* peerName = NULL; // NULL to wait for the peer to connect
+	int netplayDelay = 0;
+	int netLatency = 0; // simulated link
+	int netLoss = 0;
+	int netplayTestFrames = 0;
+	int runAheadFrames = 0; // frames shown early to hide the game's own input lag
+	u64 headlessInstructions = 0;
+	int pacing = PACING_HYBRID;
+	bool singleThread = false;
+	bool audioSync = false; // emulation speed follows the audio device clock
+	int engine = ENGINE_BLOCK;
+	int waveform = WAVE_SINE;
+	int pitch = AUDIO_TONE_HZ;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(args[i], "-headless") == 0 && i + 1 < argc)
+		{
+			headlessInstructions = strtoull(args[++i], NULL, 10);
+		}
+		else if (strcmp(args[i], "-engine") == 0 && i + 1 < argc)
+		{
+			engine = ParseEngine(args[++i]);
+		}
+		else if (strcmp(args[i], "-recompile") == 0 && i + 1 < argc)
+		{
+			recompileName = args[++i];
+		}
+		else if (strcmp(args[i], "-wave") == 0 && i + 1 < argc)
+		{
+			waveform = ParseWaveform(args[++i]);
+		}
+		else if (strcmp(args[i], "-pitch") == 0 && i + 1 < argc)
+		{
+			pitch = atoi(args[++i]);
+		}
+		else if (strcmp(args[i], "-state") == 0 && i + 1 < argc)
+		{
+			stateName = args[++i];
+		}
+		else if (strcmp(args[i], "-resume") == 0)
+		{
+			resume = true;
+		}
+		else if (strcmp(args[i], "-seed") == 0 && i + 1 < argc)
+		{
+			seed = (u32)strtoul(args[++i], NULL, 0);
+		}
+		else if (strcmp(args[i], "-record") == 0 && i + 1 < argc)
+		{
+			recordName = args[++i];
+		}
+		else if (strcmp(args[i], "-replay") == 0 && i + 1 < argc)
+		{
+			replayName = args[++i];
+		}
+		else if (strcmp(args[i], "-seek") == 0 && i + 1 < argc)
+		{
+			seekFrame = strtoull(args[++i], NULL, 10);
+		}
+		else if (strcmp(args[i], "-netplay") == 0 && i + 1 < argc)
+		{
+			netplayPort = atoi(args[++i]);
+		}
+		else if (strcmp(args[i], "-peer") == 0 && i + 1 < argc)
+		{
+			peerName = args[++i];
+		}
+		else if (strcmp(args[i], "-delay") == 0 && i + 1 < argc)
+		{
+			netplayDelay = atoi(args[++i]);
+		}
+		else if (strcmp(args[i], "-netsim") == 0 && i + 2 < argc)
+		{
+			netLatency = atoi(args[++i]);
+			netLoss = atoi(args[++i]);
+		}
+		else if (strcmp(args[i], "-netplaytest") == 0 && i + 1 < argc)
+		{
+			netplayTestFrames = atoi(args[++i]);
+		}
+		else if (strcmp(args[i], "-runahead") == 0 && i + 1 < argc)
+		{
+			runAheadFrames = atoi(args[++i]);
+		}
+		else if (strcmp(args[i], "-spin") == 0)
+		{
+			pacing = PACING_SPIN;
+		}
+		else if (strcmp(args[i], "-singlethread") == 0)
+		{
+			singleThread = true;
+		}
+		else if (strcmp(args[i], "-audiosync") == 0)
+		{
+			audioSync = true;
+		}
+		else
+		{
+			romName = args[i];
+		}
+	}
+
+	if (recompileName)
+	{
+		return Recompile(romName, recompileName);
+	}
+	if (netplayTestFrames)
+	{
+		return RunNetplayTest(romName, engine, netplayTestFrames, netplayDelay, netLatency, netLoss);
+	}
+
+	c8e_Movie* movie = NULL;
+	if (replayName)
+	{
+		movie = new c8e_Movie();
+		if (!movie->Load(replayName))
 		{
-			sdl->Render(chip8->GetRenderData());
+			printf("%s: not a movie\n", replayName);
+			delete(movie);
+			return 1;
 		}
+	}
+	if (headlessInstructions)
+	{
+		int result = RunHeadless(romName, engine, headlessInstructions, seed, movie);
+		delete(movie);
+		return result;
+	}
 
-		if (chip8->GetSoundActive())
+	// initialize
+	c8e_SDL* sdl = new c8e_SDL(PROGRAM_TITLE);
+	c8e_CPU* chip8 = new c8e_CPU(romName, engine);
+	chip8->SetAudio(sdl->GetAudio());
+	audioSync = audioSync && sdl->GetAudio();
+	if (sdl->GetAudio())
+	{
+		sdl->GetAudio()->SetTone(waveform, pitch);
+	}
+
+	char statePath[SAVE_PATH_MAX];
+	snprintf(statePath, sizeof(statePath), stateName ? "%s" : "%s.state", stateName ? stateName : romName);
+	chip8->SetSeed(seed);
+	if (resume)
+	{
+		u8 blob[STATE_BLOB_SIZE];
+		size_t size;
+		if (ReadState(statePath, blob, size) && !chip8->LoadState(blob, size))
+		{
+			printf("%s: saved by a different version\n", statePath);
+		}
+	}
+	c8e_SaveWriter* saveWriter = new c8e_SaveWriter();
+	c8e_Rewind* rewind = new c8e_Rewind(); // backspace plays it backwards
+	c8e_RunAhead* runAhead = new c8e_RunAhead();
+	runAhead->SetFrames(runAheadFrames);
+
+	// loading a state or rewinding would break the movie, so both are off while one runs
+	bool replay = (movie != NULL);
+	if (replay)
+	{
+		if (!movie->Play(chip8))
+		{
+			printf("%s: recorded on a different rom\n", replayName);
+			delete(movie);
+			movie = NULL;
+			replay = false;
+		}
+		else if (seekFrame)
+		{
+			movie->Seek(chip8, movie->GetStartCycle() + seekFrame * chip8->GetClockSpeed() / TIMERSPEED);
+		}
+	}
+	else if (recordName && !netplayPort)
+	{
+		movie = new c8e_Movie();
+		movie->Record(chip8); // from the resumed state if there is one
+	}
+
+	if (netplayPort)
+	{
+		// rollbacks would land in a movie, so netplay runs without one
+		c8e_Netplay* netplay = new c8e_Netplay(chip8);
+		netplay->SetInputDelay(netplayDelay);
+		netplay->SetConditions(netLatency, netLoss);
+		if (netplay->Open((u16)netplayPort, peerName))
 		{
-			sdl->PlaySound();
+			RunNetplay(sdl, chip8, netplay);
 		}
 		else
 		{
-			sdl->StopSound();
+			printf("Netplay: could not open port %d\n", netplayPort);
 		}
+		delete(netplay);
+	}
+	else if (singleThread)
+	{
+		RunSingleThread(sdl, chip8, pacing, audioSync, saveWriter, statePath, rewind, movie, replay, runAhead);
+	}
+	else
+	{
+		RunEmuThread(sdl, chip8, pacing, audioSync, saveWriter, statePath, rewind, movie, replay, runAhead);
+	}
+
+	saveWriter->Finish(); // saves still being written
+	if (movie && !replay && !movie->Save(recordName, chip8))
+	{
+		printf("%s: could not write the movie\n", recordName);
+	}
+
+	printf("Render: %.1f us per frame, %llu unchanged frames skipped\n", sdl->GetRenderTime(), sdl->GetSkippedFrames());
+
+	u64 keyEvents = chip8->GetKeyEvents();
+	double lateMs = keyEvents ? chip8->GetKeyLateCycles() * 1000.0 / chip8->GetClockSpeed() / keyEvents : 0.0;
+	c8e_Audio* audio = sdl->GetAudio();
+	if (audio)
+	{
+		printf("Audio: %.1f ms latency, %llu underruns, %llu edges dropped\n", sdl->GetAudioLatency(), audio->GetUnderruns(), audio->GetDroppedEdges());
+		printf("Audio sync: %.1f ms buffered, speed corrected by %+.3f%%%s\n", audio->GetFill(), audio->GetRateAdjust() / 10000.0, audioSync ? "" : " (not applied)");
+	}
+	printf("Input: %llu key events, %.2f ms average lateness\n", keyEvents, lateMs);
+	printf("Idle: %.1f%% of cycles skipped\n", chip8->GetCycleCount() ? chip8->GetIdleCycles() * 100.0 / chip8->GetCycleCount() : 0.0);
+	printf("Save states: %llu written, %llu failed, %llu dropped\n", saveWriter->GetWritten(), saveWriter->GetFailed(), saveWriter->GetDropped());
+	if (movie)
+	{
+		printf("Movie: %llu key changes, %llu keyframes, %.1f s\n", (u64)movie->GetEvents(), (u64)movie->GetKeyframes(), (movie->GetEndCycle() - movie->GetStartCycle()) / (double)chip8->GetClockSpeed());
+	}
+	if (runAhead->GetFrames())
+	{
+		printf("Run-ahead: %d frames, %.2f us per frame\n", runAhead->GetFrames(), runAhead->GetRunTime());
 	}
+	printf("Rewind: %.1f s of history in %llu KB, %.2f us per capture\n", rewind->GetFrames() / (double)TIMERSPEED, (u64)rewind->GetBytesUsed() / 1024, rewind->GetCaptureTime());
 
 	// cleanup
+	delete(saveWriter);
+	delete(rewind);
+	delete(runAhead);
+	delete(movie);
 	delete(sdl);
 	delete(chip8);
 